@@ -183,6 +183,227 @@ beam_search(Point p, Graph<indexType> &G, PointRange &Points,
                         dist_cmps);
 }
 
+// A beam search that can be continued with a wider beam. Every point whose
+// distance has been computed is kept, either in the frontier or, once it was
+// trimmed off it or dropped as too far for the beam it was found with, in
+// the spilled points. Running again with a wider beam merges the spilled
+// points back into the frontier and carries on visiting from there, so no
+// distance is computed and no node is visited twice across runs. The
+// frontier a run ends with holds the closest points of everything seen so
+// far, which is at least as good as what a fresh search with the wider beam
+// would start from.
+//
+// Given an accept predicate and a number of results, the search also keeps
+// the closest accepted points it has computed a distance to in a separate
+// result queue, e.g. the points inside a label window, while the frontier
+// keeps navigating through any point. A run then stops early once the queue
+// is full and the closest unvisited frontier node is too far away, by the
+// same cut as the frontier trimming, to improve on its last entry.
+//
+// A QP.distance_bound, e.g. the k-th distance other buckets of a tree have
+// already found, never takes a point out of the frontier, since the search
+// may have to pass through far points to get anywhere. Once the search has
+// found a point under the bound, a run stops when the closest unvisited
+// frontier node is past it by more than the cut, and it is up to the caller
+// to drop the results past the bound.
+template<typename indexType>
+struct AcceptAll {
+  bool operator()(indexType) const { return true; }
+};
+
+template<typename Point, typename PointRange, typename indexType,
+         typename Accept = AcceptAll<indexType>>
+struct ResumableBeamSearch {
+  using distanceType = typename Point::distanceType;
+  using pid = std::pair<indexType, distanceType>;
+
+  ResumableBeamSearch(Point p, Graph<indexType> &G, PointRange &Points,
+                      parlay::sequence<indexType> starting_points,
+                      Accept accept = Accept(), size_t num_results = 0)
+      : p(p), G(G), Points(Points), starting_points(starting_points),
+        accept(accept), num_results(num_results) {}
+
+  // Runs until every point of a QP.beamSize wide frontier has been visited
+  // or QP.limit points have been visited over all runs, and returns the
+  // frontier
+  parlay::sequence<pid> run(QueryParams &QP) {
+    stopped_at_bound = false;
+    auto less = [&](const pid &a, const pid &b) {
+      return a.second < b.second || (a.second == b.second && a.first < b.first);
+    };
+
+    // used as a hash filter (can give false negative -- i.e. can say
+    // not in table when it is), grown with the beam
+    int bits = std::max<int>(10, std::ceil(std::log2(QP.beamSize * QP.beamSize)) - 2);
+    if (bits > hash_bits) {
+      hash_bits = bits;
+      hash_filter.assign(1 << bits, -1);
+      for (auto &v : frontier) has_been_seen(v.first);
+      for (auto &v : visited) has_been_seen(v.first);
+      for (auto &v : spilled) has_been_seen(v.first);
+    }
+
+    if (!started) {
+      started = true;
+      for (auto q : starting_points) {
+        has_been_seen(q);
+        frontier.push_back(pid(q, Points[q].distance(p)));
+        note_distance(frontier.back(), QP);
+      }
+      dist_cmps += starting_points.size();
+      std::sort(frontier.begin(), frontier.end(), less);
+    } else if (!spilled.empty()) {
+      // points too far for the earlier beams get their chance at this one
+      std::sort(spilled.begin(), spilled.end(), less);
+      spilled.erase(std::unique(spilled.begin(), spilled.end()), spilled.end());
+      std::vector<pid> merged(frontier.size() + spilled.size());
+      merged.resize(std::set_union(frontier.begin(), frontier.end(),
+                                   spilled.begin(), spilled.end(),
+                                   merged.begin(), less) -
+                    merged.begin());
+      size_t kept = std::min<size_t>(QP.beamSize, merged.size());
+      frontier.assign(merged.begin(), merged.begin() + kept);
+      spilled.assign(merged.begin() + kept, merged.end());
+    }
+    if (frontier.size() > (size_t)QP.beamSize) {
+      spilled.insert(spilled.end(), frontier.begin() + QP.beamSize, frontier.end());
+      frontier.resize(QP.beamSize);
+    }
+
+    std::vector<pid> unvisited_frontier(std::max<size_t>(QP.beamSize, frontier.size()));
+    long remain =
+        std::set_difference(frontier.begin(), frontier.end(), visited.begin(),
+                            visited.end(), unvisited_frontier.begin(), less) -
+        unvisited_frontier.begin();
+
+    std::vector<pid> new_frontier(QP.beamSize + G.max_degree());
+    std::vector<pid> candidates;
+    candidates.reserve(G.max_degree());
+    std::vector<indexType> keep;
+    keep.reserve(G.max_degree());
+
+    distanceType slack = Points[0].is_metric() ? QP.cut : 1;
+    bool bounded = QP.distance_bound < std::numeric_limits<float>::max();
+    while (remain > 0 && num_visited < QP.limit) {
+      pid current = unvisited_frontier[0];
+      if (num_results > 0 && results.size() == num_results) {
+        if (current.second > slack * results.back().second) break;
+      }
+      if (bounded && reached_bound &&
+          current.second > slack * QP.distance_bound) {
+        stopped_at_bound = true;
+        break;
+      }
+      G[current.first].prefetch();
+      visited.insert(std::upper_bound(visited.begin(), visited.end(), current, less),
+                     current);
+      num_visited++;
+
+      candidates.clear();
+      keep.clear();
+      long num_elts = std::min<long>(G[current.first].size(), QP.degree_limit);
+      for (indexType i = 0; i < num_elts; i++) {
+        auto a = G[current.first][i];
+        if (a == p.id() || has_been_seen(a)) continue;
+        keep.push_back(a);
+        Points[a].prefetch();
+      }
+
+      distanceType cutoff = ((frontier.size() < (size_t)QP.beamSize)
+                             ? (distanceType)std::numeric_limits<int>::max()
+                             : frontier[frontier.size() - 1].second);
+      for (auto a : keep) {
+        distanceType dist = Points[a].distance(p);
+        dist_cmps++;
+        note_distance(pid(a, dist), QP);
+        // past the frontier only a wider beam can use it
+        if (dist >= cutoff) {
+          spilled.push_back(pid(a, dist));
+          continue;
+        }
+        candidates.push_back(pid(a, dist));
+      }
+      std::sort(candidates.begin(), candidates.end(), less);
+
+      auto new_frontier_size =
+          std::set_union(frontier.begin(), frontier.end(), candidates.begin(),
+                         candidates.end(), new_frontier.begin(), less) -
+          new_frontier.begin();
+      size_t trimmed = std::min<size_t>(QP.beamSize, new_frontier_size);
+      if (QP.k > 0 && trimmed > (size_t)QP.k && Points[0].is_metric())
+        trimmed = (std::upper_bound(new_frontier.begin(),
+                                    new_frontier.begin() + trimmed,
+                                    pid(0, QP.cut * new_frontier[QP.k].second), less) -
+                   new_frontier.begin());
+      spilled.insert(spilled.end(), new_frontier.begin() + trimmed,
+                     new_frontier.begin() + new_frontier_size);
+      frontier.assign(new_frontier.begin(), new_frontier.begin() + trimmed);
+
+      remain =
+          std::set_difference(frontier.begin(), frontier.end(), visited.begin(),
+                              visited.end(), unvisited_frontier.begin(), less) -
+          unvisited_frontier.begin();
+    }
+
+    return parlay::to_sequence(frontier);
+  }
+
+  size_t distance_comparisons() const { return dist_cmps; }
+
+  // The closest accepted points seen so far, sorted by distance
+  parlay::sequence<pid> accepted() const { return parlay::to_sequence(results); }
+
+  // Whether the last run ended because everything left unvisited was past
+  // the distance bound, in which case a wider beam would stop in the same
+  // place
+  bool stopped_on_bound() const { return stopped_at_bound; }
+
+private:
+  Point p;
+  Graph<indexType> &G;
+  PointRange &Points;
+  parlay::sequence<indexType> starting_points;
+  Accept accept;
+  size_t num_results;
+  bool started = false;
+  bool reached_bound = false;
+  bool stopped_at_bound = false;
+  std::vector<pid> results;
+
+  std::vector<pid> frontier;
+  std::vector<pid> visited;
+  std::vector<pid> spilled;
+  int hash_bits = 0;
+  std::vector<indexType> hash_filter;
+  long num_visited = 0;
+  size_t dist_cmps = 0;
+
+  // Offers v to the results and notes whether it is under the distance bound
+  void note_distance(pid v, const QueryParams &QP) {
+    if (v.second < QP.distance_bound) reached_bound = true;
+    add_result(v);
+  }
+
+  void add_result(pid v) {
+    if (num_results == 0 || !accept(v.first)) return;
+    if (results.size() == num_results && v.second >= results.back().second) return;
+    auto less = [&](const pid &a, const pid &b) {
+      return a.second < b.second || (a.second == b.second && a.first < b.first);
+    };
+    auto position = std::lower_bound(results.begin(), results.end(), v, less);
+    if (position != results.end() && *position == v) return;
+    results.insert(position, v);
+    if (results.size() > num_results) results.pop_back();
+  }
+
+  bool has_been_seen(indexType a) {
+    int loc = parlay::hash64_2(a) & ((1 << hash_bits) - 1);
+    if (hash_filter[loc] == a) return true;
+    hash_filter[loc] = a;
+    return false;
+  }
+};
+
 // // has same functionality as above but written differently (taken from HNSW)
 // // not quite as fast and does not prune based on cut.
 // template<typename T, template<typename C> class Point, template<typename E, template<typename D> class P> class PointRange>
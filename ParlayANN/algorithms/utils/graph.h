@@ -43,7 +43,7 @@
 template<typename indexType>
 struct edgeRange{
 
-    size_t size(){return edges[0];}
+    size_t size(){return view_ ? count_ : edges[0];}
 
     indexType id(){return id_;}
 
@@ -51,11 +51,17 @@ struct edgeRange{
 
     edgeRange(indexType* start, indexType* end, indexType id) : edges(parlay::make_slice<indexType*, indexType*>(start,end)), id_(id) {maxDeg = edges.size()-1;}
 
+    //a read only view of count neighbors that are stored id_offset higher
+    //than the ids it hands out, with no degree in front of them
+    edgeRange(indexType* neighbors, size_t count, indexType id, indexType id_offset)
+        : edges(parlay::make_slice<indexType*, indexType*>(neighbors-1, neighbors+count)), maxDeg(count), id_(id),
+          id_offset_(id_offset), count_(count), view_(true) {}
+
     indexType operator [] (indexType j){
-        if(j > edges[0]){
+        if(j > size()){
             std::cout << "ERROR: tried to exceed range" << std::endl;
             abort();
-        } else return edges[j+1];
+        } else return edges[j+1] - id_offset_;
     }
 
     void append_neighbor(indexType nbh){
@@ -97,7 +103,7 @@ struct edgeRange{
     }
 
     void prefetch(){
-        int l = ((edges[0]+1) * sizeof(indexType))/64;
+        int l = ((size()+1) * sizeof(indexType))/64;
         for (int i=0; i < l; i++)
             __builtin_prefetch((char*) edges.begin() + i* 64);
     }
@@ -109,6 +115,9 @@ struct edgeRange{
         parlay::slice<indexType*, indexType*> edges;
         long maxDeg;
         indexType id_;
+        indexType id_offset_ = 0;
+        size_t count_ = 0;
+        bool view_ = false;
         
 };
 
@@ -119,10 +128,26 @@ struct Graph{
 
     Graph(){}
 
-    Graph(long maxDeg, size_t n) : maxDeg(maxDeg), n(n) {
+    Graph(long maxDeg, size_t n) : n(n), maxDeg(maxDeg) {
         graph = parlay::sequence<indexType>(n*(maxDeg+1),0);
     }
 
+    //a view of n rows of maxDeg+1 entries owned by someone else, who
+    //has to zero them before the first build and keep them alive
+    Graph(long maxDeg, size_t n, indexType* rows) : n(n), maxDeg(maxDeg), external_rows(rows) {}
+
+    //a read only view of n points of a run of segments, segment_size points
+    //each, whose rows of row_size entries someone else owns. A row holds the
+    //number of edges to the previous segment, to its own segment and to the
+    //next segment, followed by the edges in that order, stored as ids
+    //id_offset higher than the view's. The edges to the previous segment are
+    //left out for points of the first segment in the view and the edges to
+    //the next one for points of the last, so every edge stays in the view.
+    Graph(long maxDeg, size_t n, indexType* rows, size_t row_size,
+          size_t segment_size, indexType id_offset)
+        : n(n), maxDeg(maxDeg), external_rows(rows), row_size(row_size),
+          segment_size(segment_size), id_offset(id_offset) {}
+
     Graph(char* gFile){
         std::ifstream reader(gFile);
         assert(reader.is_open());
@@ -195,12 +220,31 @@ struct Graph{
         writer.close();
     }
 
-    edgeRange<indexType> operator [](indexType i) {return edgeRange<indexType>(graph.begin()+i*(maxDeg+1), graph.begin()+(i+1)*(maxDeg+1), i);}
+    edgeRange<indexType> operator [](indexType i) {
+        if (segment_size > 0) return segment_edges(i);
+        indexType* rows = external_rows != nullptr ? external_rows : graph.begin();
+        return edgeRange<indexType>(rows+i*(maxDeg+1), rows+(i+1)*(maxDeg+1), i);
+    }
+
+    bool is_view() const {return external_rows != nullptr;}
 
     private:
         size_t n;
         long maxDeg;
         parlay::sequence<indexType> graph;
+        indexType* external_rows = nullptr;
+        size_t row_size = 0;
+        size_t segment_size = 0;
+        indexType id_offset = 0;
+
+        edgeRange<indexType> segment_edges(indexType i) {
+            indexType* row = external_rows + i*row_size;
+            bool first = i < segment_size;
+            bool last = (i/segment_size + 1)*segment_size >= n;
+            indexType* begin = row + 3 + (first ? row[0] : 0);
+            size_t count = row[1] + (first ? 0 : row[0]) + (last ? 0 : row[2]);
+            return edgeRange<indexType>(begin, count, i, id_offset);
+        }
         
         
 };
\ No newline at end of file
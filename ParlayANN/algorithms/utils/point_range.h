@@ -46,6 +46,12 @@ long dim_round_up(long dim, long tp_size){
 template<typename T, class Point, class PR>
 struct SubsetPointRange;
 
+template<typename T, class Point, class PR>
+struct OffsetPointRange;
+
+template<typename T, class Point, class PR>
+struct ChunkedPointRange;
+
 template<typename T, class Point>
 struct PointRange : public std::enable_shared_from_this<PointRange<T, Point>>{
 
@@ -107,14 +113,67 @@ struct PointRange : public std::enable_shared_from_this<PointRange<T, Point>>{
     });
   }
 
+  /* n zeroed points, to be filled in through operator[] */
+  PointRange(size_t n, unsigned int dims) : dims(dims), n(n) {
+    aligned_dims = dim_round_up(dims, sizeof(T));
+    values = (T*) aligned_alloc(64, std::max<size_t>(n*aligned_dims*sizeof(T), 64));
+    std::memset(values, 0, n*aligned_dims*sizeof(T));
+  }
+
+  /* n points where point i is a copy of the dims values at row(i), e.g. a
+  permutation of another array. The rows are page aligned and filled a page at
+  a time in parallel, every page by a single task that writes all of its bytes,
+  so each page is first touched, and placed, by the worker that fills it, and
+  nothing is zeroed ahead of the copy. */
+  template<typename Row>
+  PointRange(size_t n, unsigned int dims, Row row) : dims(dims), n(n) {
+    aligned_dims = dim_round_up(dims, sizeof(T));
+    size_t row_bytes = aligned_dims*sizeof(T);
+    size_t value_bytes = dims*sizeof(T);
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t bytes = n*row_bytes;
+    size_t num_pages = std::max<size_t>((bytes + page - 1)/page, 1);
+    values = (T*) aligned_alloc(page, num_pages*page);
+    char* out = (char*) values;
+    parlay::parallel_for(0, num_pages, [&] (size_t p){
+      size_t begin = p*page;
+      size_t end = std::min(begin + page, bytes);
+      // the part of every row that lies in this page, which for the first and
+      // last row can be only some of its values or padding
+      for (size_t i = begin/row_bytes; i*row_bytes < end; i++) {
+        size_t row_start = i*row_bytes;
+        size_t from = std::max(begin, row_start);
+        size_t to = std::min(end, row_start + row_bytes);
+        size_t values_end = std::min(to, row_start + value_bytes);
+        if (from < values_end) {
+          std::memcpy(out + from, (const char*) row(i) + (from - row_start), values_end - from);
+        }
+        if (std::max(from, values_end) < to) {
+          std::memset(out + std::max(from, values_end), 0, to - std::max(from, values_end));
+        }
+      }
+    });
+  }
+
+  /* a view of n points whose rows are already padded to aligned_dimension()
+  values, e.g. in a mapped file, which backing keeps alive */
+  PointRange(T* values, size_t n, unsigned int dims, std::shared_ptr<void> backing) : values(values), dims(dims), n(n), backing(backing) {
+    aligned_dims = dim_round_up(dims, sizeof(T));
+  }
+
     ~PointRange(){
-      free(values);
+      if(backing == nullptr) free(values);
     }
 
     std::unique_ptr<SubsetPointRange<T, Point, PointRange<T, Point>>> make_subset(parlay::sequence<int32_t> subset) {
         return std::make_unique<SubsetPointRange<T, Point, PointRange<T, Point>>>(std::enable_shared_from_this<PointRange<T, Point>>::shared_from_this(), subset); // Use std::enable_shared_from_this to access shared_from_this
     }
 
+    /* a view of the contiguous points [offset, offset + n), for subsets that are a single run of points */
+    std::unique_ptr<OffsetPointRange<T, Point, PointRange<T, Point>>> make_offset_range(size_t offset, size_t n) {
+        return std::make_unique<OffsetPointRange<T, Point, PointRange<T, Point>>>(std::enable_shared_from_this<PointRange<T, Point>>::shared_from_this(), offset, n);
+    }
+
     size_t size() const { return n; }
     
     Point operator [] (long i) {
@@ -126,6 +185,7 @@ private:
   unsigned int dims;
   unsigned int aligned_dims;
   size_t n;
+  std::shared_ptr<void> backing = nullptr;
 };
 
 /* a wrapper around PointRange which uses only a subset of the points
@@ -199,4 +259,87 @@ struct SubsetPointRange {
       return std::make_unique<SubsetPointRange<T, Point, PR>>(this->pr, subset);
     }
 
-};
\ No newline at end of file
+};
+
+/* a view of the contiguous run of points [offset, offset + n) of a PointRange
+
+  Like SubsetPointRange, indices into the view are relative to its first point, but there is no subset sequence or hash map to keep: the real index is just offset + i, and a point is found with a single multiply-add from the view's first point
+ */
+template<typename T, class Point, class PR = PointRange<T, Point>>
+struct OffsetPointRange {
+    std::shared_ptr<PR> pr;
+    size_t offset;
+    size_t n;
+    unsigned int dims;
+    unsigned int aligned_dims;
+
+    OffsetPointRange() {}
+
+    OffsetPointRange(std::shared_ptr<PR> pr, size_t offset, size_t n) : pr(pr), offset(offset), n(n) {
+      dims = pr->dimension();
+      aligned_dims = pr->aligned_dimension();
+      base = (*pr)[0].get() + offset * aligned_dims;
+    }
+
+    size_t size() const { return n; }
+
+    Point operator [] (long i) {
+      return Point(base + i * aligned_dims, dims, aligned_dims, offset + i);
+    }
+
+    long dimension() const {return dims;}
+    long aligned_dimension() const {return aligned_dims;}
+
+    int32_t real_index(int32_t i) const {
+      return offset + i;
+    }
+
+    int32_t subset_index(int32_t i) const {
+      return i - offset;
+    }
+
+private:
+    T* base = nullptr;
+};
+
+/* a view of the contiguous run of points [offset, offset + n) whose rows are split over equally sized chunks, e.g. points that were appended a chunk at a time
+
+  The view starts at the first point of chunks[0], and point i lives in chunks[i / chunk_size]. Like OffsetPointRange, indices into the view are relative to its first point and the real index is offset + i.
+ */
+template<typename T, class Point, class PR = PointRange<T, Point>>
+struct ChunkedPointRange {
+    std::vector<std::shared_ptr<PR>> chunks;
+    size_t chunk_size;
+    size_t offset;
+    size_t n;
+    unsigned int dims;
+    unsigned int aligned_dims;
+
+    ChunkedPointRange() {}
+
+    ChunkedPointRange(std::vector<std::shared_ptr<PR>> chunks, size_t chunk_size, size_t offset, size_t n) : chunks(chunks), chunk_size(chunk_size), offset(offset), n(n) {
+      dims = this->chunks.at(0)->dimension();
+      aligned_dims = this->chunks.at(0)->aligned_dimension();
+      for (auto &chunk : this->chunks) bases.push_back((*chunk)[0].get());
+    }
+
+    size_t size() const { return n; }
+
+    Point operator [] (long i) {
+      return Point(bases[i / chunk_size] + (i % chunk_size) * aligned_dims, dims, aligned_dims, offset + i);
+    }
+
+    long dimension() const {return dims;}
+    long aligned_dimension() const {return aligned_dims;}
+
+    int32_t real_index(int32_t i) const {
+      return offset + i;
+    }
+
+    int32_t subset_index(int32_t i) const {
+      return i - offset;
+    }
+
+private:
+    std::vector<T*> bases;
+};
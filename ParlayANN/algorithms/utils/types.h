@@ -24,6 +24,7 @@
 #define TYPES
 
 #include <algorithm>
+#include <limits>
 
 #include "parlay/parallel.h"
 #include "parlay/primitives.h"
@@ -89,6 +90,17 @@ struct BuildParams{
 
   std::string cache_path;
 
+  bool merge_child_graphs = false; // tree indices, seed parent graphs from children
+  long merge_L = 0; // beam width of the cross-child pass, 0 means L / 4
+  bool level_graph_blocks = false; // tree indices, one adjacency block per row
+  size_t memory_budget = 0; // tree indices, bytes for points and graphs, 0 means unlimited
+  bool share_segment_graphs = false; // super tree, overlapping buckets share per segment graphs
+  long segment_stitch_degree = 0; // edges from a point to each neighbouring segment, 0 means R / 4
+  bool window_entry_points = false; // postfiltering, keep the label quantile entry points QueryParams::window_entry_points starts from
+  bool label_sorted_points = false; // prefilter index, keep a copy of the points in label order
+  bool quantized_scan = false; // prefilter index, scan int8 codes in label order and rerank the closest exactly
+  bool verbose = false; // tree indices, print per row build timings
+
   BuildParams() {}
 
   BuildParams(long R, long L, double a) : R(R), L(L), alpha(a) {}
@@ -122,6 +134,17 @@ struct QueryParams{
   long postfiltering_max_beam = 10000; // Only for postfiltering
   std::optional<float> min_query_to_bucket_ratio = std::nullopt; // Only for postfiltering
   bool verbose = false;
+  bool intra_query_parallel = false; // Only for tree search
+  bool share_distance_bound = false; // Only for tree search
+  bool reorder_by_bucket = false; // Only for tree batch search
+  bool window_aware_search = false; // Only for postfiltering, keep in-window results apart from the beam
+  double predicted_beam_safety = 0; // Only for postfiltering, first beam k * blowup * this when the window size is known, 0 means beamSize
+  bool predicted_beam_fallback = true; // Only for postfiltering, keep doubling if the predicted beam finds fewer than k
+  bool window_entry_points = false; // Only for postfiltering, start from entry points at the window's label quantiles
+  long rerank_factor = 4; // Only for prefiltering with quantized_scan, candidates reranked exactly per result
+  // Candidates at least this far away are dropped by beam_search. Tree search
+  // tightens it across buckets when share_distance_bound is set.
+  float distance_bound = std::numeric_limits<float>::max();
 
   QueryParams(long k, long Q, double cut, long limit, long dg)
       : k(k), beamSize(Q), cut(cut), limit(limit), degree_limit(dg) {}
@@ -134,6 +134,81 @@ struct knn_index {
       G[i].sort(less);});
   }
 
+  // Finishes a graph whose nodes in each of the disjoint [start, end) pieces
+  // already hold the edges of a graph built over just that piece. Points
+  // outside every piece are inserted as usual. Every other point then runs a
+  // short beam search started from the other pieces' first points, and
+  // robustPrune picks its cross-piece edges from the visited nodes alongside
+  // its existing ones. Reverse edges are added as in batch_insert.
+  void merge_pieces(GraphI &G, PR &Points, stats<indexType> &BuildStats,
+                    const parlay::sequence<std::pair<indexType, indexType>> &pieces) {
+    size_t n = G.size();
+    auto piece_of = parlay::sequence<int>(n, -1);
+    for (size_t j = 0; j < pieces.size(); j++) {
+      parlay::parallel_for(pieces[j].first, pieces[j].second,
+                           [&](size_t i) { piece_of[i] = j; });
+    }
+    start_point = pieces.size() > 0 ? pieces[0].first : 0;
+
+    auto uncovered = parlay::filter(
+        parlay::tabulate(n, [&](indexType i) { return i; }),
+        [&](indexType i) { return piece_of[i] == -1; });
+    if (uncovered.size() > 0) {
+      batch_insert(uncovered, G, Points, BuildStats, true, 2, .02);
+    }
+
+    if (pieces.size() > 1) {
+      long L = BP.merge_L > 0 ? BP.merge_L : std::max<long>(BP.L / 4, 1);
+      auto covered = parlay::filter(
+          parlay::tabulate(n, [&](indexType i) { return i; }),
+          [&](indexType i) { return piece_of[i] != -1; });
+
+      parlay::sequence<parlay::sequence<indexType>> new_out_(covered.size());
+      parlay::parallel_for(0, covered.size(), [&](size_t i) {
+        indexType index = covered[i];
+        parlay::sequence<indexType> starts;
+        for (size_t j = 0; j < pieces.size(); j++) {
+          if (j != piece_of[index]) starts.push_back(pieces[j].first);
+        }
+        QueryParams QP((long) 0, L, (double) 0.0, (long) Points.size(), (long) G.max_degree());
+        parlay::sequence<pid> visited =
+          (beam_search<Point, PointRange, indexType>(Points[index], G, Points, starts, QP)).first.second;
+        BuildStats.increment_visited(index, visited.size());
+        new_out_[i] = robustPrune(index, visited, G, Points);
+      });
+
+      // only the new cross-piece edges need a reverse edge
+      auto to_flatten = parlay::tabulate(covered.size(), [&](size_t i) {
+        indexType index = covered[i];
+        auto cross = parlay::filter(new_out_[i], [&](indexType j) {
+          return piece_of[j] != piece_of[index];
+        });
+        return parlay::map(cross, [&](indexType j) {
+          return std::make_pair(j, index);
+        });
+      });
+      parlay::parallel_for(0, covered.size(), [&](size_t i) {
+        G[covered[i]].update_neighbors(new_out_[i]);
+      });
+      auto grouped_by = parlay::group_by_key(parlay::flatten(to_flatten));
+      parlay::parallel_for(0, grouped_by.size(), [&](size_t j) {
+        auto &[index, candidates] = grouped_by[j];
+        size_t newsize = candidates.size() + G[index].size();
+        if (newsize <= BP.R) {
+          G[index].append_neighbors(candidates);
+        } else {
+          auto new_out_2_ = robustPrune(index, std::move(candidates), G, Points);
+          G[index].update_neighbors(new_out_2_);
+        }
+      });
+    }
+
+    parlay::parallel_for (0, G.size(), [&] (long i) {
+      auto less = [&] (indexType j, indexType k) {
+		    return Points[i].distance(Points[j]) < Points[i].distance(Points[k]);};
+      G[i].sort(less);});
+  }
+
   void lazy_delete(parlay::sequence<indexType> deletes, GraphI &G) {
     for (indexType p : deletes) {
       if (p > (int)G.size()) {
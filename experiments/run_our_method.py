@@ -65,6 +65,11 @@ parser.add_argument(
     "--smart_combined", action="store_true", help="Run smart combined method"
 )
 parser.add_argument("--three_split", action="store_true", help="Run three split method")
+parser.add_argument(
+    "--auto_planner",
+    action="store_true",
+    help="Run the cost model planned method",
+)
 parser.add_argument(
     "--super_opt_postfiltering",
     action="store_true",
@@ -162,6 +167,7 @@ run_vamana_tree = args.vamana_tree or args.all_methods
 run_prefiltering = args.prefiltering or args.all_methods
 run_smart_combined = args.smart_combined or args.all_methods
 run_three_split = args.three_split or args.all_methods
+run_auto_planner = args.auto_planner or args.all_methods
 run_super_opt_postfiltering = args.super_opt_postfiltering or args.all_methods
 
 if not (
@@ -171,6 +177,7 @@ if not (
     or run_prefiltering
     or run_smart_combined
     or run_three_split
+    or run_auto_planner
     or run_super_opt_postfiltering
 ):
     print("NOTE: No experiments specified, so aborting")
@@ -340,6 +347,7 @@ def run_tree_experiments(all_results, dataset_name, filter_width, alpha, split_f
         or run_optimized_postfiltering
         or run_smart_combined
         or run_three_split
+        or run_auto_planner
     ):
         return
 
@@ -479,6 +487,38 @@ def run_tree_experiments(all_results, dataset_name, filter_width, alpha, split_f
                 if should_break(all_results):
                     break
 
+    if run_auto_planner:
+        for beam_size in BEAM_SIZES:
+            for final_beam_multiply in FINAL_MULTIPLIES:
+                start = time.time()
+                query_params = wp.build_query_params(
+                    k=TOP_K,
+                    beam_size=beam_size,
+                    final_beam_multiply=final_beam_multiply,
+                    verbose=VERBOSE,
+                )
+                auto_planner_results = vamana_tree.batch_search(
+                    queries,
+                    query_filter_ranges,
+                    queries.shape[0],
+                    "auto",
+                    query_params,
+                )
+                all_results.append(
+                    (
+                        filter_width,
+                        f"auto-planner_{alpha:.3f}_{split_factor}_{beam_size}_{final_beam_multiply}",
+                        compute_recall(auto_planner_results[0], query_gt, TOP_K),
+                        time.time() - start,
+                        build_time,
+                        split_factor,
+                        memory
+                    )
+                )
+                print(all_results[-1])
+                if should_break(all_results):
+                    break
+
 
 def run_super_optimized_postfiltering_experiment(
     all_results, dataset_name, filter_width, alpha, split_factor, shift_factor
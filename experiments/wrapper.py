@@ -341,8 +341,16 @@ def build_query_params(
     postfiltering_max_beam=10000,
     min_query_to_bucket_ratio=None,
     verbose=False,
+    intra_query_parallel=False,
+    share_distance_bound=False,
+    reorder_by_bucket=False,
+    window_aware_search=False,
+    predicted_beam_safety=0,
+    predicted_beam_fallback=True,
+    window_entry_points=False,
+    rerank_factor=4,
 ):
-    return QueryParams(
+    query_params = QueryParams(
         k,
         beam_size,
         cut,
@@ -353,3 +361,12 @@ def build_query_params(
         min_query_to_bucket_ratio,
         verbose,
     )
+    query_params.intra_query_parallel = intra_query_parallel
+    query_params.share_distance_bound = share_distance_bound
+    query_params.reorder_by_bucket = reorder_by_bucket
+    query_params.window_aware_search = window_aware_search
+    query_params.predicted_beam_safety = predicted_beam_safety
+    query_params.predicted_beam_fallback = predicted_beam_fallback
+    query_params.window_entry_points = window_entry_points
+    query_params.rerank_factor = rerank_factor
+    return query_params
@@ -124,7 +124,13 @@ inline void add_variant(py::module_ &m, const Variant &variant) {
            "split_factor"_a = 2, "build_params"_a = DEFAULT_BUILD_PARAMS)
       .def("batch_search", &RangeFilterTreeIndex<T, Point>::batch_search,
            "queries"_a, "filters"_a, "num_queries"_a, "query_method"_a,
-           "query_params"_a);
+           "query_params"_a)
+      .def("append", &RangeFilterTreeIndex<T, Point>::append, "points"_a,
+           "filter_values"_a)
+      .def("expire_before", &RangeFilterTreeIndex<T, Point>::expire_before,
+           "label"_a, "rebuild_below_fill"_a = 0.5)
+      .def("save", &RangeFilterTreeIndex<T, Point>::save, "path"_a)
+      .def_static("load", &RangeFilterTreeIndex<T, Point>::load, "path"_a);
 
   py::class_<PostfilterVamanaIndex<T, Point>>(
       m, ("PostfilterVamanaIndex" + variant.agnostic_name).c_str())
@@ -142,7 +148,18 @@ inline void add_variant(py::module_ &m, const Variant &variant) {
       .def("batch_search",
            &RangeFilterTreeIndex<T, Point, PostfilterVamanaIndex>::batch_search,
            "queries"_a, "filters"_a, "num_queries"_a, "query_method"_a,
-           "query_params"_a);
+           "query_params"_a)
+      .def("append",
+           &RangeFilterTreeIndex<T, Point, PostfilterVamanaIndex>::append,
+           "points"_a, "filter_values"_a)
+      .def("expire_before",
+           &RangeFilterTreeIndex<T, Point, PostfilterVamanaIndex>::expire_before,
+           "label"_a, "rebuild_below_fill"_a = 0.5)
+      .def("save", &RangeFilterTreeIndex<T, Point, PostfilterVamanaIndex>::save,
+           "path"_a)
+      .def_static("load",
+                  &RangeFilterTreeIndex<T, Point, PostfilterVamanaIndex>::load,
+                  "path"_a);
 
   py::class_<SuperOptimizedPostfilterTree<T, Point, PostfilterVamanaIndex>>(
       m, ("SuperOptimizedPostfilterTreeIndex" + variant.agnostic_name).c_str())
@@ -154,7 +171,24 @@ inline void add_variant(py::module_ &m, const Variant &variant) {
       .def("batch_search",
            &SuperOptimizedPostfilterTree<T, Point,
                                          PostfilterVamanaIndex>::batch_search,
-           "queries"_a, "filters"_a, "num_queries"_a, "query_params"_a);
+           "queries"_a, "filters"_a, "num_queries"_a, "query_params"_a)
+      .def_static(
+          "tuned",
+          &SuperOptimizedPostfilterTree<T, Point, PostfilterVamanaIndex>::tuned,
+          "points"_a, "filter_values"_a, "cutoff"_a = 1000,
+          "max_index_multiple"_a = 20, "target_blowup"_a = 4,
+          "build_params"_a = DEFAULT_BUILD_PARAMS)
+      .def("blowup_distribution",
+           &SuperOptimizedPostfilterTree<
+               T, Point, PostfilterVamanaIndex>::blowup_distribution,
+           "num_windows"_a = 10000)
+      .def("save",
+           &SuperOptimizedPostfilterTree<T, Point, PostfilterVamanaIndex>::save,
+           "path"_a)
+      .def_static(
+          "load",
+          &SuperOptimizedPostfilterTree<T, Point, PostfilterVamanaIndex>::load,
+          "path"_a);
 }
 
 PYBIND11_MODULE(window_ann, m) {
@@ -206,11 +240,39 @@ PYBIND11_MODULE(window_ann, m) {
                     std::optional<float>, bool>(),
            "k"_a, "beam_width"_a, "cut"_a, "limit"_a, "degree_limit"_a,
            "final_beam_multiply"_a, "postfiltering_max_beam"_a,
-           "min_query_to_bucket_ratio"_a, "verbose"_a);
+           "min_query_to_bucket_ratio"_a, "verbose"_a)
+      .def_readwrite("intra_query_parallel",
+                     &QueryParams::intra_query_parallel)
+      .def_readwrite("share_distance_bound",
+                     &QueryParams::share_distance_bound)
+      .def_readwrite("reorder_by_bucket", &QueryParams::reorder_by_bucket)
+      .def_readwrite("window_aware_search",
+                     &QueryParams::window_aware_search)
+      .def_readwrite("predicted_beam_safety",
+                     &QueryParams::predicted_beam_safety)
+      .def_readwrite("predicted_beam_fallback",
+                     &QueryParams::predicted_beam_fallback)
+      .def_readwrite("window_entry_points",
+                     &QueryParams::window_entry_points)
+      .def_readwrite("rerank_factor", &QueryParams::rerank_factor);
 
   py::class_<BuildParams>(m, "BuildParams")
       .def(py::init<long, long, double, std::string>(), "max_degree"_a,
-           "limit"_a, "alpha"_a, "cache_path"_a);
+           "limit"_a, "alpha"_a, "cache_path"_a)
+      .def_readwrite("merge_child_graphs", &BuildParams::merge_child_graphs)
+      .def_readwrite("merge_L", &BuildParams::merge_L)
+      .def_readwrite("level_graph_blocks", &BuildParams::level_graph_blocks)
+      .def_readwrite("memory_budget", &BuildParams::memory_budget)
+      .def_readwrite("share_segment_graphs",
+                     &BuildParams::share_segment_graphs)
+      .def_readwrite("segment_stitch_degree",
+                     &BuildParams::segment_stitch_degree)
+      .def_readwrite("window_entry_points",
+                     &BuildParams::window_entry_points)
+      .def_readwrite("label_sorted_points",
+                     &BuildParams::label_sorted_points)
+      .def_readwrite("quantized_scan", &BuildParams::quantized_scan)
+      .def_readwrite("verbose", &BuildParams::verbose);
 
   py::class_<FilteredDataset>(m, "FilteredDataset")
       .def(py::init<std::string &, std::string &>(), "points_filename"_a,
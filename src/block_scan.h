@@ -0,0 +1,262 @@
+#pragma once
+
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+#include "algorithms/utils/euclidian_point.h"
+#include "algorithms/utils/mips_point.h"
+
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <vector>
+
+using index_type = int32_t;
+
+// Number of rows ahead of the current one that the block scan prefetches
+constexpr size_t BLOCK_SCAN_PREFETCH_DISTANCE = 8;
+// Number of distances computed before they are offered to the top k heap
+constexpr size_t BLOCK_SCAN_BATCH = 64;
+
+template <typename Point> struct is_mips_point : std::false_type {};
+template <typename T> struct is_mips_point<Mips_Point<T>> : std::true_type {};
+
+template <typename T>
+constexpr bool has_block_kernel =
+    std::is_same_v<T, float> || std::is_same_v<T, int8_t> ||
+    std::is_same_v<T, uint8_t>;
+
+/* Keeps the k closest (id, distance) pairs offered to it in a max heap, so
+ * the current k-th distance is always at the front */
+struct BoundedTopK {
+  using pid = std::pair<index_type, float>;
+
+  size_t k;
+  std::vector<pid> heap;
+
+  BoundedTopK(size_t k) : k(k) { heap.reserve(k); }
+
+  // Distance a new point has to beat to get in
+  float threshold() const {
+    return heap.size() < k ? std::numeric_limits<float>::max()
+                           : heap.front().second;
+  }
+
+  void push(index_type id, float dist) {
+    if (heap.size() < k) {
+      heap.push_back({id, dist});
+      std::push_heap(heap.begin(), heap.end(), less);
+    } else if (k > 0 && dist < heap.front().second) {
+      std::pop_heap(heap.begin(), heap.end(), less);
+      heap.back() = {id, dist};
+      std::push_heap(heap.begin(), heap.end(), less);
+    }
+  }
+
+  void merge(const BoundedTopK &other) {
+    for (auto [id, dist] : other.heap) {
+      push(id, dist);
+    }
+  }
+
+  // The kept pairs, closest first
+  parlay::sequence<pid> sorted() const {
+    auto result = parlay::to_sequence(heap);
+    std::sort(result.begin(), result.end(), less);
+    return result;
+  }
+
+private:
+  static bool less(const pid &a, const pid &b) { return a.second < b.second; }
+};
+
+#if defined(__AVX512F__)
+inline float horizontal_sum(__m512 v) { return _mm512_reduce_add_ps(v); }
+inline int32_t horizontal_sum(__m512i v) { return _mm512_reduce_add_epi32(v); }
+#endif
+
+#if defined(__AVX2__)
+inline float horizontal_sum(__m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_hadd_ps(sum, sum);
+  sum = _mm_hadd_ps(sum, sum);
+  return _mm_cvtss_f32(sum);
+}
+
+inline int32_t horizontal_sum(__m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v),
+                              _mm256_extracti128_si256(v, 1));
+  sum = _mm_hadd_epi32(sum, sum);
+  sum = _mm_hadd_epi32(sum, sum);
+  return _mm_cvtsi128_si32(sum);
+}
+
+// Widens 16 8-bit values to 16-bit lanes
+inline __m256i widen_epi8(const int8_t *p) {
+  return _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+inline __m256i widen_epi8(const uint8_t *p) {
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)p));
+}
+#endif
+
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+// Widens 32 8-bit values to 16-bit lanes, reading only the lanes in mask
+inline __m512i widen_epi8(const int8_t *p, __mmask32 mask) {
+  return _mm512_cvtepi8_epi16(_mm256_maskz_loadu_epi8(mask, p));
+}
+inline __m512i widen_epi8(const uint8_t *p, __mmask32 mask) {
+  return _mm512_cvtepu8_epi16(_mm256_maskz_loadu_epi8(mask, p));
+}
+#endif
+
+/* One query to one point, the same squared l2 as Euclidian_Point::distance
+ * or negated inner product as Mips_Point::distance. The sums are taken in a
+ * different order and with fused multiply adds, so results can differ from
+ * theirs in the last bits and near ties may be ordered the other way. */
+template <bool Mips>
+inline float block_kernel_distance(const float *q, const float *p,
+                                   unsigned d) {
+  unsigned i = 0;
+  float result = 0;
+#if defined(__AVX512F__)
+  __m512 acc = _mm512_setzero_ps();
+  for (; i < d; i += 16) {
+    __mmask16 mask = d - i >= 16 ? 0xFFFF : (__mmask16)((1u << (d - i)) - 1);
+    __m512 a = _mm512_maskz_loadu_ps(mask, q + i);
+    __m512 b = _mm512_maskz_loadu_ps(mask, p + i);
+    if constexpr (Mips) {
+      acc = _mm512_fmadd_ps(a, b, acc);
+    } else {
+      __m512 diff = _mm512_sub_ps(a, b);
+      acc = _mm512_fmadd_ps(diff, diff, acc);
+    }
+  }
+  result = horizontal_sum(acc);
+#elif defined(__AVX2__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= d; i += 8) {
+    __m256 a = _mm256_loadu_ps(q + i);
+    __m256 b = _mm256_loadu_ps(p + i);
+    if constexpr (Mips) {
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(a, b));
+    } else {
+      __m256 diff = _mm256_sub_ps(a, b);
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(diff, diff));
+    }
+  }
+  result = horizontal_sum(acc);
+#endif
+  for (; i < d; i++) {
+    if constexpr (Mips) {
+      result += q[i] * p[i];
+    } else {
+      result += (q[i] - p[i]) * (q[i] - p[i]);
+    }
+  }
+  return Mips ? -result : result;
+}
+
+template <bool Mips, typename T>
+inline std::enable_if_t<std::is_same_v<T, int8_t> || std::is_same_v<T, uint8_t>,
+                        float>
+block_kernel_distance(const T *q, const T *p, unsigned d) {
+  unsigned i = 0;
+  int32_t result = 0;
+#if defined(__AVX512BW__) && defined(__AVX512VL__)
+  // Differences and products of two 8-bit values fit in 16 bits, and madd
+  // sums adjacent pairs of their products into 32 bits
+  __m512i acc = _mm512_setzero_si512();
+  for (; i < d; i += 32) {
+    __mmask32 mask = d - i >= 32 ? 0xFFFFFFFFu : (1u << (d - i)) - 1;
+    __m512i a = widen_epi8(q + i, mask);
+    __m512i b = widen_epi8(p + i, mask);
+    if constexpr (Mips) {
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(a, b));
+    } else {
+      __m512i diff = _mm512_sub_epi16(a, b);
+      acc = _mm512_add_epi32(acc, _mm512_madd_epi16(diff, diff));
+    }
+  }
+  result = horizontal_sum(acc);
+#elif defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 16 <= d; i += 16) {
+    __m256i a = widen_epi8(q + i);
+    __m256i b = widen_epi8(p + i);
+    if constexpr (Mips) {
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(a, b));
+    } else {
+      __m256i diff = _mm256_sub_epi16(a, b);
+      acc = _mm256_add_epi32(acc, _mm256_madd_epi16(diff, diff));
+    }
+  }
+  result = horizontal_sum(acc);
+#endif
+  for (; i < d; i++) {
+    int32_t a = q[i];
+    int32_t b = p[i];
+    result += Mips ? a * b : (a - b) * (a - b);
+  }
+  return Mips ? -((float)result) : (float)result;
+}
+
+/* Distances from one query to `count` points laid out back to back, `stride`
+ * elements apart starting at base. Rows further ahead are prefetched with a
+ * non-temporal hint since a scan touches every row exactly once. */
+template <bool Mips, typename T>
+inline void block_distances(const T *q, const T *base, size_t stride,
+                            size_t count, unsigned d, float *out) {
+  size_t row_bytes = d * sizeof(T);
+  for (size_t i = 0; i < count; i++) {
+    if (i + BLOCK_SCAN_PREFETCH_DISTANCE < count) {
+      const char *ahead =
+          (const char *)(base + (i + BLOCK_SCAN_PREFETCH_DISTANCE) * stride);
+      for (size_t line = 0; line < row_bytes; line += 64) {
+        _mm_prefetch(ahead + line, _MM_HINT_NTA);
+      }
+    }
+    out[i] = block_kernel_distance<Mips>(q, base + i * stride, d);
+  }
+}
+
+/* Offers every point in [start, end) of points to top_k. The points have to
+ * sit contiguously in memory, as they do in a PointRange, and ids are
+ * reported as indices into points. Falls back to Point::distance for types
+ * without a kernel. */
+template <typename Point, typename PR>
+void scan_contiguous_block(Point query, PR &points, size_t start, size_t end,
+                           BoundedTopK &top_k) {
+  using T = std::remove_pointer_t<decltype(query.get())>;
+  if (start >= end) {
+    return;
+  }
+
+  if constexpr (has_block_kernel<T>) {
+    const T *q = query.get();
+    const T *base = points[start].get();
+    size_t stride = points.aligned_dimension();
+    unsigned d = points.dimension();
+
+    float distances[BLOCK_SCAN_BATCH];
+    for (size_t block = start; block < end; block += BLOCK_SCAN_BATCH) {
+      size_t count = std::min(BLOCK_SCAN_BATCH, end - block);
+      block_distances<is_mips_point<Point>::value>(
+          q, base + (block - start) * stride, stride, count, d, distances);
+      float threshold = top_k.threshold();
+      for (size_t i = 0; i < count; i++) {
+        if (distances[i] < threshold) {
+          top_k.push(block + i, distances[i]);
+          threshold = top_k.threshold();
+        }
+      }
+    }
+  } else {
+    for (size_t i = start; i < end; i++) {
+      top_k.push(i, points[i].distance(query));
+    }
+  }
+}
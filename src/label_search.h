@@ -0,0 +1,83 @@
+#pragma once
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+using index_type = int32_t;
+
+/* A static lower bound search over a sorted list of filter values. The values
+ * are copied into Eytzinger order, a complete binary tree stored breadth
+ * first with the children of node k at 2k and 2k + 1, so every search walks
+ * down the same few cache lines at the top of the tree, and the nodes four
+ * levels below the current one sit in a single cache line that is prefetched
+ * while the current level is compared. A search then costs about one cache
+ * miss for every four levels instead of one per level of a binary search over
+ * the sorted values, plus one to translate the node back to a sorted
+ * position. */
+template <typename FilterType> struct LabelSearchIndex {
+  // Nodes of a cache line aligned block, the descendants of a node that are
+  // log2(NODES_PER_LINE) levels below it
+  static constexpr size_t NODES_PER_LINE = 64 / sizeof(FilterType);
+
+  LabelSearchIndex() {}
+
+  explicit LabelSearchIndex(const parlay::sequence<FilterType> &sorted)
+      : n(sorted.size()) {
+    // Node k lives at nodes[k], node 0 is unused so that the block holding
+    // the descendants of node k starts at a multiple of NODES_PER_LINE
+    size_t bytes = (n + 1) * sizeof(FilterType);
+    bytes = (bytes + 63) / 64 * 64;
+    nodes = std::shared_ptr<FilterType>(
+        static_cast<FilterType *>(
+            std::aligned_alloc(64, std::max<size_t>(bytes, 64))),
+        std::free);
+    sorted_positions = parlay::sequence<index_type>(n + 1, 0);
+
+    // An in order walk of the tree visits the nodes in sorted order
+    std::vector<size_t> stack;
+    size_t position = 0;
+    size_t k = 1;
+    while (k <= n || !stack.empty()) {
+      if (k <= n) {
+        stack.push_back(k);
+        k = 2 * k;
+      } else {
+        k = stack.back();
+        stack.pop_back();
+        nodes.get()[k] = sorted[position];
+        sorted_positions[k] = position;
+        position++;
+        k = 2 * k + 1;
+      }
+    }
+  }
+
+  size_t size() const { return n; }
+
+  // Returns the position in the sorted values of the first one that is
+  // greater than or equal to value, or size() if there is none
+  size_t first_greater_than_or_equal_to(const FilterType &value) const {
+    const FilterType *tree = nodes.get();
+    size_t k = 1;
+    while (k <= n) {
+      __builtin_prefetch(tree + k * NODES_PER_LINE);
+      k = 2 * k + (tree[k] < value);
+    }
+    // The path went right at every node smaller than value, the lower bound
+    // is the last node where it went left
+    k >>= __builtin_ffsll(~k);
+    return k == 0 ? n : sorted_positions[k];
+  }
+
+private:
+  size_t n = 0;
+  std::shared_ptr<FilterType> nodes;
+  parlay::sequence<index_type> sorted_positions;
+};
@@ -26,6 +26,17 @@ namespace py = pybind11;
 using NeighborsAndDistances =
     std::pair<py::array_t<unsigned int>, py::array_t<float>>;
 
+// Label quantile segments a postfiltering index keeps an entry point for
+constexpr size_t POSTFILTER_ENTRY_POINTS = 8;
+
+// The rows of an already built graph, e.g. in a mapped snapshot, for an index
+// to serve in place
+struct PrebuiltGraph {
+  index_type *rows;
+
+  explicit PrebuiltGraph(index_type *rows) : rows(rows) {}
+};
+
 template <typename T, typename Point, class PR = PointRange<T, Point>,
           typename FilterType = float_t>
 struct PostfilterVamanaIndex {
@@ -41,12 +52,46 @@ struct PostfilterVamanaIndex {
 
   parlay::sequence<index_type> indices;
 
+  // The point closest to the centroid of each run of points between two
+  // label quantiles, with the labels the run spans. Only kept with
+  // BuildParams::window_entry_points, or restored from a snapshot.
+  struct EntryPoint {
+    index_type id;
+    FilterType first;
+    FilterType last;
+  };
+  std::vector<EntryPoint> entry_points;
+
   PostfilterVamanaIndex(std::shared_ptr<PR> &&points,
                         parlay::sequence<FilterType> filter_values,
                         BuildParams build_params)
+      : PostfilterVamanaIndex(
+            std::move(points), filter_values, build_params,
+            std::vector<std::pair<size_t, PostfilterVamanaIndex *>>()) {}
+
+  // Builds the graph by merging the graphs of already built children. Each
+  // child is given with the offset of its first point in this index, and
+  // together the children must index disjoint, contiguous runs of points.
+  // Points not covered by any child are inserted from scratch.
+  //
+  // If graph_rows is given, the graph lives in those zeroed
+  // points->size() * (R + 1) entries owned by the caller instead of in an
+  // allocation of its own.
+  PostfilterVamanaIndex(
+      std::shared_ptr<PR> &&points, parlay::sequence<FilterType> filter_values,
+      BuildParams build_params,
+      const std::vector<std::pair<size_t, PostfilterVamanaIndex *>> &children,
+      index_type *graph_rows = nullptr)
       : points(std::move(points)), filter_values(filter_values),
         build_params(build_params) {
 
+    if (graph_rows != nullptr) {
+      this->G = Graph<index_type>(build_params.R, this->points->size(),
+                                  graph_rows);
+    } else {
+      this->G = Graph<index_type>(build_params.R, this->points->size());
+    }
+
     this->range = std::make_pair(
         *(std::min_element(filter_values.begin(), filter_values.end())),
         *(std::max_element(filter_values.begin(), filter_values.end())));
@@ -58,7 +103,12 @@ struct PostfilterVamanaIndex {
                 << std::endl;
 
       std::string filename = this->graph_filename(cache_path);
-      this->G = Graph<index_type>(filename.data());
+      auto cached = Graph<index_type>(filename.data());
+      parlay::parallel_for(0, cached.size(), [&](index_type i) {
+        auto edges = cached[i];
+        this->G[i].update_neighbors(
+            parlay::tabulate(edges.size(), [&](size_t j) { return edges[j]; }));
+      });
     } else {
       // std::cout << "Building graph" << std::endl;
       // this->start_point = indices[0];
@@ -68,8 +118,35 @@ struct PostfilterVamanaIndex {
       // std::cout << "This filter has " << indices.size() << " points" <<
       // std::endl;
 
-      this->G = Graph<index_type>(build_params.R, this->points->size());
-      I.build_index(this->G, *(this->points), BuildStats);
+      if (children.empty()) {
+        I.build_index(this->G, *(this->points), BuildStats);
+      } else {
+        parlay::sequence<std::pair<index_type, index_type>> pieces;
+        for (auto [offset, child] : children) {
+          parlay::parallel_for(0, child->G.size(), [&](index_type i) {
+            auto edges = child->G[i];
+            auto neighbors = parlay::tabulate(
+                edges.size(), [&](size_t j) { return edges[j]; });
+            // A view of shared segment graphs holds up to R edges plus the
+            // stitches to both neighbouring segments, of which the R closest
+            // are kept
+            size_t degree = std::min<size_t>(edges.size(), build_params.R);
+            if (degree < neighbors.size()) {
+              auto p = (*child->points)[i];
+              auto by_distance = parlay::map(neighbors, [&](index_type j) {
+                return std::make_pair(p.distance((*child->points)[j]), j);
+              });
+              std::sort(by_distance.begin(), by_distance.end());
+              neighbors = parlay::tabulate(
+                  degree, [&](size_t j) { return by_distance[j].second; });
+            }
+            this->G[offset + i].update_neighbors(parlay::map(
+                neighbors, [&](index_type j) { return j + offset; }));
+          });
+          pieces.push_back(std::make_pair(offset, offset + child->G.size()));
+        }
+        I.merge_pieces(this->G, *(this->points), BuildStats, pieces);
+      }
 
       if (cache_path != "") {
         this->save_graph(cache_path);
@@ -78,13 +155,34 @@ struct PostfilterVamanaIndex {
       }
     }
 
-    if constexpr (std::is_same<PR, PointRange<T, Point>>::value) {
-      this->indices = parlay::tabulate(this->points->size(),
-                                       [&](index_type i) { return i; });
-    } else {
-      this->indices = parlay::tabulate(this->points->size(), [&](index_type i) {
-        return this->points->subset[i];
-      });
+    set_indices();
+    if (build_params.window_entry_points) {
+      set_entry_points();
+    }
+  }
+
+  // Serves the points->size() * (R + 1) graph entries at graph.rows without
+  // building anything. The caller keeps them alive.
+  PostfilterVamanaIndex(std::shared_ptr<PR> &&points,
+                        parlay::sequence<FilterType> filter_values,
+                        BuildParams build_params, PrebuiltGraph graph)
+      : PostfilterVamanaIndex(
+            std::move(points), filter_values, build_params,
+            Graph<index_type>(build_params.R, points->size(), graph.rows)) {}
+
+  // Serves a view of a graph someone else built and keeps alive, e.g. the
+  // segment graphs that overlapping buckets share
+  PostfilterVamanaIndex(std::shared_ptr<PR> &&points,
+                        parlay::sequence<FilterType> filter_values,
+                        BuildParams build_params, Graph<index_type> graph)
+      : points(std::move(points)), G(graph), build_params(build_params),
+        filter_values(filter_values) {
+    this->range = std::make_pair(
+        *(std::min_element(filter_values.begin(), filter_values.end())),
+        *(std::max_element(filter_values.begin(), filter_values.end())));
+    set_indices();
+    if (build_params.window_entry_points) {
+      set_entry_points();
     }
   }
 
@@ -124,7 +222,9 @@ struct PostfilterVamanaIndex {
   }
 
   std::string graph_filename(std::string cache_path) {
-    return cache_path + "vamana_" + std::to_string(build_params.L) + "_" +
+    std::string prefix =
+        build_params.merge_child_graphs ? "merged_vamana_" : "vamana_";
+    return cache_path + prefix + std::to_string(build_params.L) + "_" +
            std::to_string(build_params.R) + "_" +
            std::to_string(build_params.alpha) + "_" +
            std::to_string(range.first) + "_" + std::to_string(range.second) +
@@ -137,54 +237,55 @@ struct PostfilterVamanaIndex {
     this->G.save(filename.data());
   }
 
-  // Does a postfiltering query on the underlying index
-  parlay::sequence<pid> query(const Point &q,
-                              const std::pair<FilterType, FilterType> filter,
-                              QueryParams query_params) {
-    size_t knn = query_params.k;
-    QueryParams actual_params = {query_params.beamSize,
-                                 query_params.beamSize,
-                                 query_params.cut,
-                                 query_params.limit,
-                                 query_params.degree_limit,
-                                 query_params.final_beam_multiply,
-                                 query_params.postfiltering_max_beam,
-                                 query_params.min_query_to_bucket_ratio,
-                                 query_params.verbose};
-    parlay::sequence<pid> frontier = {};
-    if (query_params.verbose) {
-      std::cout << "Starting optimized postfiltering, beam size = "
-                << actual_params.beamSize << ", k = " << knn
-                << ", final multiply = " << query_params.final_beam_multiply
-                << ", n = " << filter_values.size() << std::endl;
-    }
-    while (frontier.size() < knn &&
-           actual_params.beamSize < query_params.postfiltering_max_beam) {
-      frontier = this->raw_query(q, filter, actual_params);
-      if (query_params.verbose) {
-        std::cout << "Finished a double, frontier size = " << frontier.size()
-                  << ", beam size = " << actual_params.beamSize << std::endl;
-      }
-      if (frontier.size() < knn) {
-        actual_params.beamSize *= 2;
-        actual_params.k = actual_params.beamSize;
+  // The graph as points->size() rows of max_degree + 1 entries, R if not
+  // given, each a degree followed by the neighbors, which is the layout
+  // PrebuiltGraph expects
+  parlay::sequence<index_type> packed_graph(long max_degree = 0) {
+    size_t row_size = (max_degree > 0 ? max_degree : build_params.R) + 1;
+    auto rows = parlay::sequence<index_type>(this->G.size() * row_size, 0);
+    parlay::parallel_for(0, this->G.size(), [&](index_type i) {
+      auto edges = this->G[i];
+      rows[i * row_size] = edges.size();
+      for (size_t j = 0; j < edges.size(); j++) {
+        rows[i * row_size + 1 + j] = edges[j];
       }
-    }
-    size_t final_beam_size = std::min<size_t>(
-        actual_params.beamSize * query_params.final_beam_multiply,
-        query_params.postfiltering_max_beam);
+    });
+    return rows;
+  }
 
-    if (final_beam_size > actual_params.beamSize) {
-      actual_params.beamSize = final_beam_size;
-      actual_params.k = final_beam_size;
-      frontier = this->raw_query(q, filter, actual_params);
-    }
-    if (query_params.verbose) {
-      std::cout << "Final frontier size = " << frontier.size()
-                << ", final beam size " << actual_params.beamSize << std::endl;
+  // Does a postfiltering query on the underlying index. Each doubling of the
+  // beam, and the final wider beam, continues the search the previous one
+  // left off instead of starting over.
+  //
+  // With window_aware_search set, the in-window results are kept apart from
+  // the beam, which navigates through any point, and each round stops once
+  // they can no longer improve, so the beam does not have to grow until k
+  // in-window points fit in it.
+  //
+  // A caller that knows in_window_count, how many of the points are inside
+  // the window, can have the first beam sized to hold about k of them with
+  // predicted_beam_safety, instead of doubling up to that size.
+  //
+  // With window_entry_points set, the search starts from the entry points
+  // whose label runs overlap the window rather than from point 0, if the
+  // index was built with BuildParams::window_entry_points.
+  parlay::sequence<pid> query(const Point &q,
+                              const std::pair<FilterType, FilterType> filter,
+                              QueryParams query_params,
+                              size_t in_window_count = 0) {
+    if (query_params.window_aware_search) {
+      auto in_window = [&](index_type i) {
+        FilterType filter_value = filter_values[i];
+        return filter_value >= filter.first && filter_value <= filter.second;
+      };
+      ResumableBeamSearch<Point, PR, index_type, decltype(in_window)> search(
+          q, this->G, *(this->points), start_points(filter, query_params),
+          in_window, query_params.k);
+      return doubling_query(search, filter, query_params, in_window_count);
     }
-
-    return frontier;
+    BeamSearch search(q, this->G, *(this->points),
+                      start_points(filter, query_params));
+    return doubling_query(search, filter, query_params, in_window_count);
   }
 
   // Does a batch of doubling postfiltering queries on the underlying index
@@ -219,17 +320,187 @@ struct PostfilterVamanaIndex {
   }
 
 private:
-  // Does a raw ANN query on the underlying index
+  void set_indices() {
+    if constexpr (std::is_same<PR, PointRange<T, Point>>::value) {
+      this->indices = parlay::tabulate(this->points->size(),
+                                       [&](index_type i) { return i; });
+    } else {
+      this->indices = parlay::tabulate(this->points->size(), [&](index_type i) {
+        return this->points->real_index(i);
+      });
+    }
+  }
+
+  // Splits the points into POSTFILTER_ENTRY_POINTS runs by label and keeps
+  // the point closest to the centroid of each run. Tree buckets already hold
+  // their points in label order, so they are only sorted if they are not.
+  void set_entry_points() {
+    size_t n = this->points->size();
+    auto by_label = parlay::tabulate(n, [](index_type i) { return i; });
+    if (!parlay::is_sorted(filter_values)) {
+      parlay::stable_sort_inplace(by_label, [&](index_type a, index_type b) {
+        return filter_values[a] < filter_values[b];
+      });
+    }
+    size_t num_runs = std::min(POSTFILTER_ENTRY_POINTS, n);
+    size_t dims = this->points->dimension();
+    entry_points = std::vector<EntryPoint>(num_runs);
+    parlay::parallel_for(
+        0, num_runs,
+        [&](size_t run) {
+          size_t start = run * n / num_runs;
+          size_t end = (run + 1) * n / num_runs;
+          auto centroid = std::vector<double>(dims, 0);
+          for (size_t i = start; i < end; i++) {
+            T *values = (*this->points)[by_label[i]].get();
+            for (size_t d = 0; d < dims; d++) {
+              centroid[d] += values[d];
+            }
+          }
+          for (auto &value : centroid) {
+            value /= end - start;
+          }
+          index_type closest = by_label[start];
+          double closest_distance = std::numeric_limits<double>::max();
+          for (size_t i = start; i < end; i++) {
+            T *values = (*this->points)[by_label[i]].get();
+            double distance = 0;
+            for (size_t d = 0; d < dims; d++) {
+              double difference = values[d] - centroid[d];
+              distance += difference * difference;
+            }
+            if (distance < closest_distance) {
+              closest = by_label[i];
+              closest_distance = distance;
+            }
+          }
+          entry_points[run] = {closest, filter_values[by_label[start]],
+                               filter_values[by_label[end - 1]]};
+        },
+        1);
+  }
+
+  // Where a search for filter starts: point 0, or with window_entry_points
+  // set the entry points of the label runs the window overlaps, if any
+  parlay::sequence<index_type>
+  start_points(const std::pair<FilterType, FilterType> &filter,
+               const QueryParams &query_params) const {
+    parlay::sequence<index_type> starts;
+    if (query_params.window_entry_points) {
+      for (auto &entry : entry_points) {
+        if (entry.first <= filter.second && entry.last >= filter.first) {
+          starts.push_back(entry.id);
+        }
+      }
+    }
+    if (starts.empty()) {
+      starts.push_back(0);
+    }
+    return starts;
+  }
+
+  using BeamSearch = ResumableBeamSearch<Point, PR, index_type>;
+
+  // Doubles the beam of search until it holds k in-filter results, then runs
+  // it once more final_beam_multiply times wider
+  template <typename Search>
   parlay::sequence<pid>
-  raw_query(const Point &q, const std::pair<FilterType, FilterType> filter,
+  doubling_query(Search &search, const std::pair<FilterType, FilterType> filter,
+                 QueryParams query_params, size_t in_window_count) {
+    size_t knn = query_params.k;
+    QueryParams actual_params = query_params;
+    bool predicted =
+        in_window_count > 0 && query_params.predicted_beam_safety > 0;
+    if (predicted) {
+      // Enough to hold the in-window points wanted, or all of them if there
+      // are fewer than k, but never wider than the index
+      double blowup = (double)filter_values.size() / in_window_count;
+      double wanted = std::min(knn, in_window_count);
+      double beam =
+          std::ceil(wanted * blowup * query_params.predicted_beam_safety);
+      long widest = std::min<long>(filter_values.size(),
+                                   query_params.postfiltering_max_beam);
+      actual_params.beamSize =
+          std::clamp<long>(beam, query_params.beamSize,
+                           std::max<long>(query_params.beamSize, widest));
+    }
+    actual_params.k = actual_params.beamSize;
+    parlay::sequence<pid> frontier = {};
+    if (query_params.verbose) {
+      std::cout << "Starting optimized postfiltering, beam size = "
+                << actual_params.beamSize << ", k = " << knn
+                << ", final multiply = " << query_params.final_beam_multiply
+                << ", n = " << filter_values.size() << std::endl;
+    }
+    // At least one round runs, even if the first beam, e.g. a predicted one,
+    // is already as wide as postfiltering_max_beam
+    float kth_distance = std::numeric_limits<float>::max();
+    do {
+      frontier = this->raw_query(search, filter, actual_params);
+      if (query_params.verbose) {
+        std::cout << "Finished a double, frontier size = " << frontier.size()
+                  << ", beam size = " << actual_params.beamSize << std::endl;
+      }
+      // Everything the search left unvisited is past the distance bound, so
+      // the results under it are all this index has to add
+      if (search.stopped_on_bound()) {
+        break;
+      }
+      if (predicted && !query_params.predicted_beam_fallback) {
+        break;
+      }
+      // Results kept apart from the beam can still improve with a wider
+      // beam once there are k of them, so the beam grows until they do not
+      if (frontier.size() >= knn) {
+        if (!query_params.window_aware_search ||
+            frontier[knn - 1].second >= kth_distance) {
+          break;
+        }
+        kth_distance = frontier[knn - 1].second;
+      }
+      actual_params.beamSize *= 2;
+      actual_params.k = actual_params.beamSize;
+    } while (actual_params.beamSize < query_params.postfiltering_max_beam);
+    size_t final_beam_size = std::min<size_t>(
+        actual_params.beamSize * query_params.final_beam_multiply,
+        query_params.postfiltering_max_beam);
+
+    if (final_beam_size > actual_params.beamSize &&
+        !search.stopped_on_bound()) {
+      actual_params.beamSize = final_beam_size;
+      actual_params.k = final_beam_size;
+      frontier = this->raw_query(search, filter, actual_params);
+    }
+    if (query_params.verbose) {
+      std::cout << "Final frontier size = " << frontier.size()
+                << ", final beam size " << actual_params.beamSize << ", "
+                << search.distance_comparisons()
+                << " distance comparisons" << std::endl;
+    }
+
+    // The doubling above goes by every in-filter result, those past the
+    // distance bound are only dropped now
+    if (query_params.distance_bound < std::numeric_limits<float>::max()) {
+      frontier = parlay::filter(frontier, [&](const pid &p) {
+        return p.second < query_params.distance_bound;
+      });
+    }
+    return frontier;
+  }
+
+  // Runs the ANN search on the underlying index out to the beam width of
+  // query_params and returns the in-filter results
+  template <typename Search>
+  parlay::sequence<pid>
+  raw_query(Search &search, const std::pair<FilterType, FilterType> filter,
             QueryParams query_params) {
-    auto [pairElts, dist_cmps] = beam_search<Point, PR, index_type>(
-        q, this->G, *(this->points), 0, query_params);
-    // auto [frontier, visited] = pairElts;
-    auto frontier = pairElts.first;
+    auto frontier = search.run(query_params);
     if (query_params.verbose) {
       std::cout << "Unfiltered return = " << frontier.size() << std::endl;
     }
+    if (query_params.window_aware_search) {
+      frontier = search.accepted();
+    }
 
     if constexpr (std::is_same<PR, PointRange<T, Point>>::value) {
       frontier = parlay::filter(frontier, [&](pid &p) {
@@ -243,7 +514,7 @@ private:
         FilterType filter_value = filter_values[p.first];
         if (filter_value >= filter.first && filter_value <= filter.second) {
           return std::optional<pid>(
-              std::make_pair(points->subset[p.first], p.second));
+              std::make_pair(points->real_index(p.first), p.second));
         } else {
           return std::optional<pid>();
         }
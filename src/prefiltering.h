@@ -8,12 +8,17 @@
 #include "algorithms/utils/point_range.h"
 
 #include <algorithm>
+#include <memory>
 #include <limits>
 #include <type_traits>
 #include <vector>
 
 #include "pybind11/numpy.h"
 
+#include "block_scan.h"
+#include "label_search.h"
+#include "scalar_quantizer.h"
+
 using index_type = int32_t;
 using FilterType = float;
 
@@ -23,6 +28,12 @@ using NeighborsAndDistances =
 
 using pid = std::pair<index_type, float>;
 
+// Windows of more points than this are scanned in pieces of this size in
+// parallel, each into its own top k
+constexpr size_t PREFILTER_SCAN_SPLIT_SIZE = 1 << 15;
+// Candidates per result that a scan over quantized codes reranks exactly
+constexpr size_t PREFILTER_DEFAULT_RERANK_FACTOR = 4;
+
 /* a minimal index that does prefiltering at query time. A good faith
  * prefiltering should probably be a fenwick tree */
 template <typename T, class Point, class PR = SubsetPointRange<T, Point>>
@@ -34,25 +45,35 @@ struct PrefilterIndex {
   parlay::sequence<FilterType> filter_values_sorted;
   parlay::sequence<index_type>
       filter_indices_sorted; // the indices of the points sorted by filter value
+  LabelSearchIndex<FilterType> label_search; // over filter_values_sorted
+  // With BuildParams::label_sorted_points, a copy of the points in the order
+  // of filter_values_sorted, so that a window is one contiguous run of
+  // points, and their ids in the original dataset
+  std::unique_ptr<PointRange<T, Point>> sorted_points;
+  parlay::sequence<index_type> sorted_ids;
+  // With BuildParams::quantized_scan, int8 codes of the points in the same
+  // order, which windows are scanned over before the closest candidates are
+  // reranked against the points themselves
+  using CodePoint = std::conditional_t<is_mips_point<Point>::value,
+                                       Mips_Point<int8_t>,
+                                       Euclidian_Point<int8_t>>;
+  std::unique_ptr<PointRange<int8_t, CodePoint>> codes;
+  ScalarQuantizer quantizer;
 
   std::pair<FilterType, FilterType> range;
 
-  // BuildParams is unused for now but kept for API consistency
   PrefilterIndex(std::shared_ptr<PR> &&points,
                  parlay::sequence<FilterType> filter_values,
                  BuildParams build_params)
       : points(std::move(points)), filter_values(std::move(filter_values)) {
 
-    // These are unused, but kept for API consistency
-    (void)build_params;
-
     auto n = this->points->size();
 
     if constexpr (std::is_same<PR, PointRange<T, Point>>()) {
       indices = parlay::tabulate(n, [](int32_t i) { return i; });
     } else {
       indices = parlay::tabulate(
-          n, [&](int32_t i) { return this->points->subset[i]; });
+          n, [&](int32_t i) { return this->points->real_index(i); });
     }
 
     filter_values_sorted = parlay::sequence<FilterType>(n);
@@ -68,11 +89,18 @@ struct PrefilterIndex {
       filter_values_sorted[i] = this->filter_values[filter_indices_sorted[i]];
     });
 
+    label_search = LabelSearchIndex<FilterType>(filter_values_sorted);
     range =
         std::make_pair(filter_values_sorted[0], filter_values_sorted[n - 1]);
+
+    if (build_params.label_sorted_points || build_params.quantized_scan) {
+      sort_points(build_params.label_sorted_points);
+    }
+    if (build_params.quantized_scan) {
+      quantize_points();
+    }
   }
 
-  // BuildParams is unused for now but kept for API consistency
   PrefilterIndex(py::array_t<T> points, py::array_t<FilterType> filter_values,
                  BuildParams build_params) {
     py::buffer_info points_buf = points.request();
@@ -117,8 +145,16 @@ struct PrefilterIndex {
       filter_values_sorted[i] = this->filter_values[filter_indices_sorted[i]];
     });
 
+    label_search = LabelSearchIndex<FilterType>(filter_values_sorted);
     range =
         std::make_pair(filter_values_sorted[0], filter_values_sorted[n - 1]);
+
+    if (build_params.label_sorted_points || build_params.quantized_scan) {
+      sort_points(build_params.label_sorted_points);
+    }
+    if (build_params.quantized_scan) {
+      quantize_points();
+    }
   }
 
   NeighborsAndDistances batch_search(
@@ -145,61 +181,152 @@ struct PrefilterIndex {
     return std::make_pair(ids, dists);
   }
 
+  // in_window_count is only taken for the same interface as the graph
+  // indices, the trees pass it to every bucket. A prefiltered scan already
+  // knows which points are in the window.
   parlay::sequence<pid> query(Point q, std::pair<FilterType, FilterType> filter,
-                              QueryParams query_params) {
-    return query_knn(q, filter, query_params.k);
+                              QueryParams query_params,
+                              [[maybe_unused]] size_t in_window_count = 0) {
+    return query_knn(q, filter, query_params.k, query_params.distance_bound,
+                     query_params.rerank_factor);
   }
 
-  /* processes a single query */
-  parlay::sequence<pid> query_knn(Point q,
-                                  std::pair<FilterType, FilterType> filter,
-                                  uint64_t knn = 10) {
-    size_t start;
-
-    size_t l, r, mid;
-    l = 0;
-    r = filter_values_sorted.size() - 1;
-    while (l < r) {
-      mid = (l + r) / 2;
-      if (filter_values_sorted[mid] < filter.first) {
-        l = mid + 1;
-      } else {
-        r = mid;
+  /* processes a single query, points at least distance_bound away are
+   * dropped. With quantized codes, the closest knn * rerank_factor points by
+   * code are reranked by their exact distances. */
+  parlay::sequence<pid>
+  query_knn(Point q, std::pair<FilterType, FilterType> filter,
+            uint64_t knn = 10,
+            float distance_bound = std::numeric_limits<float>::max(),
+            size_t rerank_factor = PREFILTER_DEFAULT_RERANK_FACTOR) {
+    // Neither bound goes past the last point, as with the binary searches
+    // these lookups replaced
+    size_t last = filter_values_sorted.size() - 1;
+    size_t start = std::min(
+        label_search.first_greater_than_or_equal_to(filter.first), last);
+    size_t end = std::min(
+        label_search.first_greater_than_or_equal_to(filter.second), last);
+
+    parlay::sequence<pid> frontier;
+    size_t num_candidates = knn * std::max<size_t>(rerank_factor, 1);
+    if (codes != nullptr && end - start > num_candidates) {
+      frontier = scan_codes(q, start, end, knn, num_candidates);
+    } else if (sorted_points != nullptr) {
+      frontier = to_original_ids(
+          scan_window(q, *sorted_points, start, end, knn).sorted());
+    } else {
+      BoundedTopK top_k(knn);
+      for (auto j = start; j < end; j++) {
+        index_type index = filter_indices_sorted[j];
+        Point p = (*points)[index];
+        top_k.push(indices[index], q.distance(p));
       }
+      frontier = top_k.sorted();
     }
-    start = l;
 
-    size_t end;
-
-    l = 0;
-    r = filter_values_sorted.size() - 1;
-    while (l < r) {
-      mid = (l + r) / 2;
-      if (filter_values_sorted[mid] < filter.second) {
-        l = mid + 1;
-      } else {
-        r = mid;
-      }
+    if (distance_bound < std::numeric_limits<float>::max()) {
+      frontier = parlay::filter(
+          frontier, [&](const pid &p) { return p.second < distance_bound; });
     }
-    end = l;
 
-    auto frontier = parlay::sequence<std::pair<index_type, float>>(
-        end - start, std::make_pair(-1, std::numeric_limits<float>::max()));
+    return frontier;
+  }
+
+private:
+  // Records the original ids of the points in label order, and copies the
+  // points themselves into sorted_points when copy_points is set
+  void sort_points(bool copy_points) {
+    size_t n = filter_indices_sorted.size();
+    if (copy_points) {
+      sorted_points = std::make_unique<PointRange<T, Point>>(
+          n, this->points->dimension(),
+          [&](size_t j) { return (*points)[filter_indices_sorted[j]].get(); });
+    }
+    sorted_ids = parlay::tabulate(
+        n, [&](size_t j) { return indices[filter_indices_sorted[j]]; });
+  }
 
-    for (auto j = start; j < end; j++) {
-      index_type index = filter_indices_sorted[j];
-      Point p = (*points)[index];
-      float dist = q.distance(p);
-      frontier.at(j - start) = {indices[index], dist};
+  // Encodes the points into codes in label order
+  void quantize_points() {
+    if constexpr (std::is_same_v<T, float>) {
+      size_t n = filter_indices_sorted.size();
+      unsigned dims = this->points->dimension();
+      quantizer = ScalarQuantizer(
+          n, dims, [&](size_t i) { return (*points)[i].get(); },
+          is_mips_point<Point>::value);
+      codes = std::make_unique<PointRange<int8_t, CodePoint>>(n, dims);
+      parlay::parallel_for(0, n, [&](size_t j) {
+        quantizer.encode((*points)[filter_indices_sorted[j]].get(),
+                         (*codes)[j].get());
+      });
+    } else {
+      throw std::runtime_error(
+          "quantized_scan only applies to points of floats");
     }
+  }
 
-    parlay::sort_inplace(frontier,
-                         [&](auto a, auto b) { return a.second < b.second; });
+  // The closest k of the points [start, end) of range, scanned in blocks as
+  // one stream, or in parallel pieces for large windows. Ids are positions
+  // in range.
+  template <typename ScanPoint, typename ScanRange>
+  BoundedTopK scan_window(ScanPoint q, ScanRange &range, size_t start,
+                          size_t end, size_t k) {
+    size_t num_pieces = (end - start + PREFILTER_SCAN_SPLIT_SIZE - 1) /
+                        PREFILTER_SCAN_SPLIT_SIZE;
+    BoundedTopK top_k(k);
+    if (num_pieces <= 1) {
+      scan_contiguous_block(q, range, start, end, top_k);
+      return top_k;
+    }
+    auto pieces = parlay::tabulate(
+        num_pieces,
+        [&](size_t piece) {
+          size_t piece_start = start + piece * PREFILTER_SCAN_SPLIT_SIZE;
+          BoundedTopK piece_top_k(k);
+          scan_contiguous_block(
+              q, range, piece_start,
+              std::min(piece_start + PREFILTER_SCAN_SPLIT_SIZE, end),
+              piece_top_k);
+          return piece_top_k;
+        },
+        1);
+    for (auto &piece_top_k : pieces) {
+      top_k.merge(piece_top_k);
+    }
+    return top_k;
+  }
 
-    if (frontier.size() > knn) {
-      frontier.pop_tail(frontier.size() - knn);
+  // Scans the codes of [start, end) for num_candidates points and returns
+  // the closest knn of them by exact distance
+  parlay::sequence<pid> scan_codes(Point q, size_t start, size_t end,
+                                   size_t knn, size_t num_candidates) {
+    parlay::sequence<pid> frontier;
+    if constexpr (std::is_same_v<T, float>) {
+      std::vector<int8_t> query_code(codes->aligned_dimension(), 0);
+      quantizer.encode_query(q.get(), query_code.data());
+      CodePoint code(query_code.data(), codes->dimension(),
+                     codes->aligned_dimension(), -1);
+      auto candidates = scan_window(code, *codes, start, end, num_candidates);
+
+      // The candidates are reranked from the copy in label order if there
+      // is one, and through filter_indices_sorted otherwise
+      BoundedTopK top_k(knn);
+      for (auto [position, code_distance] : candidates.heap) {
+        Point p = sorted_points != nullptr
+                      ? (*sorted_points)[position]
+                      : (*points)[filter_indices_sorted[position]];
+        top_k.push(position, q.distance(p));
+      }
+      frontier = to_original_ids(top_k.sorted());
     }
+    return frontier;
+  }
 
+  // Maps positions in the sorted points to ids in the original dataset
+  parlay::sequence<pid> to_original_ids(parlay::sequence<pid> frontier) {
+    for (auto &[id, dist] : frontier) {
+      id = sorted_ids[id];
+    }
     return frontier;
   }
 };
@@ -8,16 +8,22 @@
 #include "algorithms/utils/point_range.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdint>
 #include <limits>
 #include <memory>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #include "pybind11/numpy.h"
 
+#include "block_scan.h"
+#include "label_search.h"
 #include "postfilter_vamana.h"
 #include "prefiltering.h"
+#include "search_cost_model.h"
+#include "snapshot.h"
 
 #include "tree_utils.h"
 
@@ -35,15 +41,24 @@ struct RangeFilterTreeIndex {
   using pid = std::pair<index_type, float>;
 
   using PR = PointRange<T, Point>;
-  using SubsetRange = SubsetPointRange<T, Point>;
-  using SubsetRangePtr = std::unique_ptr<SubsetRange>;
+  // Every bucket is a contiguous run of the sorted points
+  using BucketRange = OffsetPointRange<T, Point>;
+  using BucketRangePtr = std::unique_ptr<BucketRange>;
 
-  using SpatialIndex = RangeSpatialIndex<T, Point, SubsetRange>;
-  using SpatialIndexPtr = std::unique_ptr<SpatialIndex>;
+  using SpatialIndex = RangeSpatialIndex<T, Point, BucketRange>;
+  // Shared, so that a bucket an expiry rebuild replaces outlives the queries
+  // still running on it
+  using SpatialIndexPtr = std::shared_ptr<SpatialIndex>;
 
   using FilterRange = std::pair<FilterType, FilterType>;
   using FilterList = parlay::sequence<FilterType>;
 
+  // Buckets of appended points, whose rows are spread over the leaves they
+  // were appended into
+  using AppendedRange = ChunkedPointRange<T, Point>;
+  using AppendedIndex = RangeSpatialIndex<T, Point, AppendedRange>;
+  using AppendedIndexPtr = std::shared_ptr<AppendedIndex>;
+
   // This constructor just sorts the input points and turns them into a
   // structure that's easier to work with. The actual work of building the index
   // happens in the private constructor below.
@@ -58,6 +73,338 @@ struct RangeFilterTreeIndex {
         split_factor, build_params);
   }
 
+  // Adds points whose filter values are all at least the largest filter value
+  // in the index, without rebuilding it. They go after the sorted points,
+  // into leaves of cutoff points. A leaf is sealed into a bucket once it is
+  // full, and once split_factor buckets of a row are sealed, a bucket over
+  // all of them is built in the row above, like carries in a binary counter.
+  // Each appended point is part of at most one bucket build per row. Appended
+  // points get the ids following those of all earlier points. The new points
+  // and buckets are published at once when the append is done, so a
+  // concurrent batch_search sees either all of them or none. Must not run
+  // concurrently with another append or with expire_before.
+  void append(py::array_t<T> points, py::array_t<FilterType> filter_values) {
+    py::buffer_info points_buf = points.request();
+    if (points_buf.ndim != 2) {
+      throw std::runtime_error("points numpy array must be 2-dimensional");
+    }
+    size_t n = points_buf.shape[0];
+    size_t dimension = points_buf.shape[1];
+    if (dimension != (size_t)_points->dimension()) {
+      throw std::runtime_error(
+          "appended points must have the dimension of the index");
+    }
+
+    py::buffer_info filter_values_buf = filter_values.request();
+    if (filter_values_buf.ndim != 1) {
+      throw std::runtime_error("filter data numpy array must be 1-dimensional");
+    }
+    if ((size_t)filter_values_buf.shape[0] != n) {
+      throw std::runtime_error("filter data numpy array must have the same "
+                               "number of elements as the points array");
+    }
+    if (n == 0) {
+      return;
+    }
+
+    T *numpy_data = static_cast<T *>(points_buf.ptr);
+    FilterType *filter_values_data =
+        static_cast<FilterType *>(filter_values_buf.ptr);
+
+    auto order = parlay::tabulate(n, [](size_t i) { return i; });
+    parlay::stable_sort_inplace(order, [&](auto i, auto j) {
+      return filter_values_data[i] < filter_values_data[j];
+    });
+
+    auto appended = std::make_shared<AppendedState>(*appended_state());
+    FilterType largest = appended->filter_values.empty()
+                             ? _filter_values.back()
+                             : appended->filter_values.back();
+    if (filter_values_data[order[0]] < largest) {
+      throw std::runtime_error("appended filter values must be at least the "
+                               "largest filter value in the index");
+    }
+
+    // The last leaf may be shared with the published state, whose queries
+    // only read its rows before first_position
+    size_t leaf_size = _cutoff;
+    size_t first_position = appended->filter_values.size();
+    size_t first_id =
+        _sorted_index_to_original_point_id.size() + first_position;
+    while (appended->leaves.size() * leaf_size < first_position + n) {
+      appended->leaves.push_back(std::make_shared<PR>(leaf_size, dimension));
+    }
+    parlay::parallel_for(0, n, [&](size_t j) {
+      size_t position = first_position + j;
+      std::memcpy((*appended->leaves.at(position / leaf_size))[position %
+                                                               leaf_size]
+                      .get(),
+                  numpy_data + order[j] * dimension, dimension * sizeof(T));
+    });
+    for (size_t j = 0; j < n; j++) {
+      appended->filter_values.push_back(filter_values_data[order[j]]);
+      appended->original_ids.push_back(first_id + order[j]);
+    }
+
+    seal_appended_buckets(*appended);
+    std::atomic_store(&_appended,
+                      std::shared_ptr<const AppendedState>(std::move(appended)));
+  }
+
+  // Drops every point with a filter value below label, for retention. Buckets
+  // that only hold dropped points are taken out right away. A bucket that still
+  // holds some live points keeps answering queries, which never look below
+  // the label again, until fewer than rebuild_below_fill of the points its
+  // graph was built on are live, and then it is rebuilt on the live ones
+  // alone. The rebuilt bucket is built aside and swapped in atomically, so a
+  // query never finds the slot empty. Buckets taken out or replaced are kept
+  // until no query holds them any more, and point rows and level graph rows
+  // that no bucket reads then are handed back to the kernel.
+  void expire_before(FilterType label, double rebuild_below_fill = 0.5) {
+    if (label <= _expiry_watermark) {
+      return;
+    }
+    _expiry_watermark = label;
+
+    size_t expired = _label_search.first_greater_than_or_equal_to(label);
+    if (_first_live_buckets.empty()) {
+      _first_live_buckets = std::vector<size_t>(_bucket_offsets.size(), 0);
+      _live_index_starts = std::vector<size_t>(_bucket_offsets.size(), 0);
+    }
+
+    std::vector<BucketBuildTask> rebuilds;
+    for (size_t row = 0; row < _bucket_offsets.size(); row++) {
+      const auto &offsets = _bucket_offsets.at(row);
+      auto num_buckets = offsets.size() - 1;
+      auto &first_live = _first_live_buckets.at(row);
+      while (first_live < num_buckets &&
+             offsets.at(first_live + 1) <= expired) {
+        retire_bucket(row, first_live, SpatialIndexPtr());
+        first_live++;
+        _live_index_starts.at(row) = offsets.at(first_live);
+      }
+      if (first_live == num_buckets) {
+        continue;
+      }
+      auto end = offsets.at(first_live + 1);
+      auto index_start = _live_index_starts.at(row);
+      if (expired > index_start &&
+          end - expired < rebuild_below_fill * (end - index_start)) {
+        rebuilds.push_back({row, first_live, expired, end});
+      }
+    }
+
+    // Every row rebuilds at most its first live bucket, into a graph of its
+    // own, so the bucket's level graph rows are released with the bucket
+    auto rebuilt = std::vector<SpatialIndexPtr>(_bucket_offsets.size());
+    run_bucket_builds(
+        rebuilds, _build_params.verbose, [&](const BucketBuildTask &task) {
+          rebuilt.at(task.row) =
+              create_index(_filter_values, task.start, task.end, _points.get(),
+                           row_build_params(task.row));
+        });
+    for (auto &task : rebuilds) {
+      retire_bucket(task.row, task.bucket, std::move(rebuilt.at(task.row)));
+      _live_index_starts.at(task.row) = task.start;
+    }
+    release_retired_buckets();
+
+    // Graphs of buckets that are not rebuilt yet, and of replaced buckets
+    // that queries still hold, walk through their dropped points, so only
+    // what lies before every one of them is released
+    auto released = *std::min_element(_live_index_starts.begin(),
+                                      _live_index_starts.end());
+    for (auto &bucket : _retired_buckets) {
+      released = std::min(released, bucket.start);
+    }
+    if (released > 0) {
+      release_pages((*_points)[0].get(),
+                    released * _points->aligned_dimension() * sizeof(T));
+    }
+    // Level graph rows before a row's first live bucket belong to freed
+    // buckets, unless a query still holds one of them. Releasing the prefix
+    // as a whole also returns the pages the buckets share at their edges.
+    for (size_t row = 0; row < _level_graphs.size(); row++) {
+      const auto &offsets = _bucket_offsets.at(row);
+      size_t unread = offsets.at(
+          std::min(_first_live_buckets.at(row), offsets.size() - 1));
+      for (auto &bucket : _retired_buckets) {
+        if (bucket.row == row && bucket.level_rows) {
+          unread = std::min(unread, bucket.start);
+        }
+      }
+      release_pages(_level_graphs.at(row).data(),
+                    unread * (_row_degrees.at(row) + 1) * sizeof(index_type));
+    }
+
+    auto appended = appended_state();
+    if (!appended->filter_values.empty() &&
+        label > appended->filter_values.front()) {
+      expire_appended(*appended, label);
+    }
+  }
+
+  // Writes the whole index, with its sorted points, labels, bucket layout
+  // and bucket graphs, to a single snapshot file that load maps back
+  void save(const std::string &path) {
+    if (!appended_state()->filter_values.empty()) {
+      throw std::runtime_error(
+          "Snapshots of indices with appended points are not supported");
+    }
+    if (!_first_live_buckets.empty()) {
+      throw std::runtime_error(
+          "Snapshots of indices with expired points are not supported");
+    }
+    SnapshotWriter writer(path);
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.kind = static_cast<uint32_t>(SnapshotKind::RangeFilterTree);
+    header.value_size = sizeof(T);
+    header.filter_size = sizeof(FilterType);
+    header.num_points = _points->size();
+    header.dims = _points->dimension();
+    header.aligned_dims = _points->aligned_dimension();
+    header.cutoff = _cutoff;
+    header.split_factor = _split_factor;
+    header.max_degree = supports_snapshots ? _build_params.R : 0;
+    write_snapshot_build_params(header, _build_params);
+    header.num_rows = _bucket_offsets.size();
+
+    header.decoding_offset = writer.start_section();
+    auto decoding = parlay::map(_sorted_index_to_original_point_id,
+                                [](size_t i) { return (uint64_t)i; });
+    writer.write(decoding.data(), decoding.size() * sizeof(uint64_t));
+
+    header.filter_values_offset = writer.start_section();
+    writer.write(_filter_values.data(),
+                 _filter_values.size() * sizeof(FilterType));
+
+    header.points_offset = writer.start_section();
+    if (_points->size() > 0) {
+      writer.write((*_points)[0].get(),
+                   _points->size() * _points->aligned_dimension() * sizeof(T));
+    }
+
+    header.geometry_offset = writer.start_section();
+    // Per row, the bucket offsets followed by the degree of the row
+    auto geometry = std::vector<std::vector<uint64_t>>(0);
+    for (size_t row = 0; row < _bucket_offsets.size(); row++) {
+      auto &offsets = _bucket_offsets.at(row);
+      geometry.push_back(std::vector<uint64_t>(offsets.begin(), offsets.end()));
+      geometry.back().push_back(_row_degrees.at(row));
+    }
+    write_snapshot_geometry(writer, geometry);
+
+    header.graphs_offset = writer.start_section();
+    if constexpr (supports_snapshots) {
+      for (auto &row : _spatial_indices) {
+        for (auto &bucket : row) {
+          auto rows = bucket->packed_graph();
+          writer.write(rows.data(), rows.size() * sizeof(index_type));
+        }
+      }
+    }
+
+    header.entry_points_offset = writer.start_section();
+    if constexpr (supports_snapshots) {
+      for (auto &row : _spatial_indices) {
+        for (auto &bucket : row) {
+          write_snapshot_list(writer, bucket->entry_points);
+        }
+      }
+    }
+
+    writer.finish(header);
+  }
+
+  // Maps a snapshot written by save. The points and bucket graphs are served
+  // from the mapping in place, only the labels are copied.
+  static RangeFilterTreeIndex load(const std::string &path) {
+    auto snapshot = std::make_shared<MappedSnapshot>(path);
+    snapshot->check_layout(SnapshotKind::RangeFilterTree, sizeof(T),
+                           sizeof(FilterType), supports_snapshots);
+    const SnapshotHeader &header = snapshot->header();
+    size_t n = header.num_points;
+
+    RangeFilterTreeIndex index;
+    index._snapshot = snapshot;
+    index._cutoff = header.cutoff;
+    index._split_factor = header.split_factor;
+    // The buckets get their entry points from the snapshot below, rather
+    // than finding them again
+    auto build_params = snapshot_build_params(header);
+    index._build_params = build_params;
+    index._build_params.window_entry_points = false;
+
+    auto decoding = snapshot->at<uint64_t>(header.decoding_offset, n);
+    index._sorted_index_to_original_point_id =
+        parlay::sequence<size_t>(decoding, decoding + n);
+    auto filter_values =
+        snapshot->at<FilterType>(header.filter_values_offset, n);
+    index._filter_values = FilterList(filter_values, filter_values + n);
+    index._label_search = LabelSearchIndex<FilterType>(index._filter_values);
+
+    index._points = std::make_shared<PR>(
+        snapshot->at<T>(header.points_offset, n * header.aligned_dims), n,
+        header.dims, snapshot);
+    if (index._points->aligned_dimension() != header.aligned_dims) {
+      throw std::runtime_error("Snapshot point rows are padded differently");
+    }
+
+    for (auto &row_geometry : snapshot->geometry()) {
+      index._bucket_offsets.push_back(
+          std::vector<size_t>(row_geometry.begin(), row_geometry.end() - 1));
+      index._row_degrees.push_back(row_geometry.back());
+    }
+
+    // Bucket graphs follow each other row by row, each bucket taking one
+    // graph row per point
+    std::vector<BucketBuildTask> tasks;
+    std::vector<uint64_t> graph_offsets;
+    uint64_t graph_offset = header.graphs_offset;
+    for (size_t row = 0; row < index._bucket_offsets.size(); row++) {
+      auto num_buckets = index._bucket_offsets.at(row).size() - 1;
+      index._spatial_indices.push_back(std::vector<SpatialIndexPtr>(num_buckets));
+      for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+        auto start = index._bucket_offsets.at(row).at(bucket);
+        auto end = index._bucket_offsets.at(row).at(bucket + 1);
+        tasks.push_back({row, bucket, start, end});
+        graph_offsets.push_back(graph_offset);
+        graph_offset += (end - start) * (index._row_degrees.at(row) + 1) *
+                        sizeof(index_type);
+      }
+    }
+
+    parlay::parallel_for(0, tasks.size(), [&](size_t i) {
+      auto &task = tasks[i];
+      index_type *graph_rows = nullptr;
+      if constexpr (supports_snapshots) {
+        graph_rows = snapshot->at<index_type>(
+            graph_offsets[i],
+            (task.end - task.start) * (index._row_degrees.at(task.row) + 1));
+      }
+      index._spatial_indices.at(task.row).at(task.bucket) = load_index(
+          index._filter_values, task.start, task.end, index._points.get(),
+          index.row_build_params(task.row), graph_rows);
+    });
+
+    // Entry points are restored rather than found again, which would read
+    // every point of every bucket
+    if constexpr (supports_snapshots) {
+      uint64_t entry_points_offset = header.entry_points_offset;
+      for (auto &row : index._spatial_indices) {
+        for (auto &bucket : row) {
+          bucket->entry_points =
+              snapshot->list<typename SpatialIndex::EntryPoint>(
+                  entry_points_offset);
+        }
+      }
+    }
+    index._build_params = build_params;
+
+    return index;
+  }
+
   /* the bounds here are inclusive */
   NeighborsAndDistances batch_search(
       py::array_t<T, py::array::c_style | py::array::forcecast> &queries,
@@ -67,24 +414,61 @@ struct RangeFilterTreeIndex {
     py::array_t<unsigned int> ids({num_queries, knn});
     py::array_t<float> dists({num_queries, knn});
 
-    parlay::parallel_for(0, num_queries, [&](auto i) {
+    auto order = parlay::tabulate(num_queries, [](size_t i) { return i; });
+    if (query_params.reorder_by_bucket) {
+      order = order_queries_by_bucket(num_queries, [&](size_t i) {
+        return smallest_containing_bucket(
+            _label_search.first_greater_than_or_equal_to(filters[i].first),
+            _label_search.first_greater_than_or_equal_to(filters[i].second));
+      });
+    }
+
+    std::shared_ptr<const SearchCostModel> model;
+    if (query_method == "auto") {
+      model = cost_model();
+    }
+    // The whole batch searches the appended points as they were when it
+    // started, whatever append does meanwhile
+    auto appended = appended_state();
+    size_t num_sorted = _points->size();
+
+    parlay::parallel_for(0, num_queries, [&](auto position) {
+      auto i = order[position];
       Point q = Point(queries.data(i), _points->dimension(),
                       _points->aligned_dimension(), i);
       FilterRange filter = filters[i];
+      // Expired points are never returned
+      filter.first = std::max(filter.first, _expiry_watermark);
+      bool live = filter.first <= filter.second;
 
       parlay::sequence<pid> results;
-      if (query_method == "optimized_postfilter") {
-        results = optimized_postfiltering_search(q, filter, query_params);
-      } else if (query_method == "three_split") {
-        results = three_split_search(q, filter, query_params);
-      } else {
-        results = fenwick_tree_search(q, filter, query_params);
+      if (live && (appended->filter_values.empty() ||
+                   filter.first <= _filter_values.back())) {
+        if (query_method == "auto") {
+          results = planned_search(q, filter, query_params, *model);
+        } else if (query_method == "optimized_postfilter") {
+          results = optimized_postfiltering_search(q, filter, query_params);
+        } else if (query_method == "three_split") {
+          results = three_split_search(q, filter, query_params);
+        } else {
+          results = fenwick_tree_search(q, filter, query_params);
+        }
+      }
+      if (live && !appended->filter_values.empty() &&
+          filter.second >= appended->filter_values.front()) {
+        for (auto pid : appended_search(*appended, q, filter, query_params)) {
+          results.push_back(pid);
+        }
+        sort_and_truncate(results, knn);
       }
 
       for (auto j = 0; j < knn; j++) {
         if (j < results.size()) {
+          auto id = results[j].first;
           ids.mutable_at(i, j) =
-              _sorted_index_to_original_point_id.at(results[j].first);
+              id < num_sorted
+                  ? _sorted_index_to_original_point_id.at(id)
+                  : appended->original_ids.at(id - num_sorted);
           dists.mutable_at(i, j) = results[j].second;
         } else {
           ids.mutable_at(i, j) = 0;
@@ -102,9 +486,21 @@ private:
   std::vector<std::vector<size_t>> _bucket_offsets;
   std::vector<std::vector<SpatialIndexPtr>> _spatial_indices;
 
+  // Max degree of the bucket graphs of each row, build_params.R unless a
+  // memory budget shrank it
+  std::vector<long> _row_degrees;
+
+  // With build_params.level_graph_blocks, row i of the tree keeps the graphs
+  // of all of its buckets in _level_graphs[i], n * (R_i + 1) entries
+  // addressed by sorted point id, and each bucket graph is a view of its own
+  // id range
+  std::vector<parlay::sequence<index_type>> _level_graphs;
+
   parlay::sequence<size_t> _sorted_index_to_original_point_id;
 
   FilterList _filter_values;
+  // Lower bound searches over _filter_values
+  LabelSearchIndex<FilterType> _label_search;
 
   int32_t _cutoff;
 
@@ -112,51 +508,152 @@ private:
 
   size_t _split_factor;
 
+  // Measured on the first "auto" query, see cost_model
+  std::shared_ptr<const SearchCostModel> _cost_model;
+
+  BuildParams _build_params;
+
+  // Everything queries read about the appended points. append and
+  // expire_before build a new state aside and swap it in, and a query holds
+  // the state it started with, buckets and leaves included, until it is done.
+  struct AppendedState {
+    // Filter values of the appended points, which come after all of the
+    // filter values of the sorted points
+    FilterList filter_values;
+    // Original ids of the appended points, in the same order
+    parlay::sequence<size_t> original_ids;
+    // The appended points, cutoff per leaf, the last leaf possibly partial
+    std::vector<std::shared_ptr<PR>> leaves;
+    // Row i holds the sealed buckets of cutoff * split_factor^i appended
+    // points, the smallest first, unlike _spatial_indices
+    std::vector<std::vector<AppendedIndexPtr>> rows;
+    // Appended points before this position have been expired
+    size_t expired = 0;
+  };
+  std::shared_ptr<const AppendedState> _appended =
+      std::make_shared<const AppendedState>();
+
+  // Filter values below the watermark have been expired. Row i has freed all
+  // of its buckets before _first_live_buckets[i], and the graph of its first
+  // live bucket covers the sorted points from _live_index_starts[i] to the
+  // end of the bucket. Both are empty until the first expiry.
+  FilterType _expiry_watermark = std::numeric_limits<FilterType>::lowest();
+  std::vector<size_t> _first_live_buckets;
+  std::vector<size_t> _live_index_starts;
+
+  // A bucket an expiry rebuild replaced, whose graph covered the sorted
+  // points [start, end) of its row, kept until no query holds it
+  struct RetiredBucket {
+    SpatialIndexPtr index;
+    size_t row;
+    size_t start;
+    size_t end;
+    // Whether its graph is a view of the row's level graph rows
+    bool level_rows;
+  };
+  std::vector<RetiredBucket> _retired_buckets;
+
+  // The mapped file a loaded index serves its points and graphs from
+  std::shared_ptr<MappedSnapshot> _snapshot;
+
+  // Already built buckets inside a new bucket, each with the offset of its
+  // first point in the new bucket
+  using ChildIndices = std::vector<std::pair<size_t, SpatialIndex *>>;
+
+  static constexpr bool supports_child_merge =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, const ChildIndices &>;
+
+  static constexpr bool supports_level_blocks =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, const ChildIndices &, index_type *>;
+
+  using AppendedChildIndices = std::vector<std::pair<size_t, AppendedIndex *>>;
+
+  static constexpr bool supports_appended_merge =
+      std::is_constructible_v<AppendedIndex, std::unique_ptr<AppendedRange> &&,
+                              FilterList, BuildParams,
+                              const AppendedChildIndices &>;
+
+  static constexpr bool supports_snapshots =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, PrebuiltGraph>;
+
+  // Buckets that serve a prebuilt graph are the ones that search a graph
+  static constexpr bool has_bucket_graphs = supports_snapshots;
+
+  // Recreates a bucket of a loaded snapshot, serving its graph from
+  // graph_rows if the index type has one
+  static SpatialIndexPtr load_index(FilterList &filter_values, size_t start,
+                                    size_t end, PR *points,
+                                    BuildParams build_params,
+                                    index_type *graph_rows) {
+    if constexpr (supports_snapshots) {
+      return std::make_unique<SpatialIndex>(
+          points->make_offset_range(start, end - start),
+          FilterList(filter_values.begin() + start,
+                     filter_values.begin() + end),
+          build_params, PrebuiltGraph(graph_rows));
+    } else {
+      return create_index(filter_values, start, end, points, build_params);
+    }
+  }
+
   static SpatialIndexPtr create_index(FilterList &filter_values, size_t start,
                                       size_t end, PR *points,
-                                      BuildParams build_params) {
-    auto filter_length = end - start;
-    parlay::sequence<int32_t> subset_of_indices = parlay::tabulate<int32_t>(
-        filter_length, [&](auto i) { return i + start; });
-    SubsetRangePtr subset_points = points->make_subset(subset_of_indices);
+                                      BuildParams build_params,
+                                      const ChildIndices &children = {},
+                                      index_type *graph_rows = nullptr) {
+    BucketRangePtr subset_points =
+        points->make_offset_range(start, end - start);
     FilterList subset_of_filter_values =
         FilterList(filter_values.begin() + start, filter_values.begin() + end);
 
+    if constexpr (supports_level_blocks) {
+      if (graph_rows != nullptr) {
+        return std::make_unique<SpatialIndex>(std::move(subset_points),
+                                              subset_of_filter_values,
+                                              build_params, children,
+                                              graph_rows);
+      }
+    }
+    if constexpr (supports_child_merge) {
+      if (!children.empty()) {
+        return std::make_unique<SpatialIndex>(std::move(subset_points),
+                                              subset_of_filter_values,
+                                              build_params, children);
+      }
+    }
     return std::make_unique<SpatialIndex>(
         std::move(subset_points), subset_of_filter_values, build_params);
   }
 
+  RangeFilterTreeIndex() {}
+
   RangeFilterTreeIndex(std::shared_ptr<PR> points,
                        const FilterList &filter_values,
                        const parlay::sequence<size_t> &decoding, int32_t cutoff,
                        size_t split_factor, BuildParams build_params)
       : _sorted_index_to_original_point_id(decoding), _cutoff(cutoff),
-        _filter_values(filter_values), _points(std::move(points)),
-        _split_factor(split_factor) {
+        _filter_values(filter_values), _label_search(filter_values),
+        _points(std::move(points)),
+        _split_factor(split_factor), _build_params(build_params) {
 
     auto n = _points->size();
 
-    _spatial_indices.push_back(std::vector<SpatialIndexPtr>(1));
-    _spatial_indices.at(0).at(0) = create_index(
-        _filter_values, 0, _filter_values.size(), _points.get(), build_params);
-    _bucket_offsets.push_back({0, _filter_values.size()});
-
-    // TODO: Parallelize the outer loop?
-
+    // The bucket geometry only depends on n and the split factor, so lay out
+    // every row first and then build all of the buckets as one pool of tasks
+    _bucket_offsets.push_back({0, n});
     while (_bucket_offsets.back().at(1) > cutoff) {
-
-      auto last_num_buckets = _spatial_indices.back().size();
-      _bucket_offsets.push_back(
-          std::vector<size_t>(last_num_buckets * _split_factor + 1));
-      _bucket_offsets.back().back() = _filter_values.size();
-      _spatial_indices.push_back(
-          std::vector<SpatialIndexPtr>(last_num_buckets * _split_factor));
-
-      parlay::parallel_for(0, last_num_buckets, [&](auto last_bucket_id) {
-        auto last_start =
-            _bucket_offsets.at(_bucket_offsets.size() - 2).at(last_bucket_id);
-        auto last_end = _bucket_offsets.at(_bucket_offsets.size() - 2)
-                            .at(last_bucket_id + 1);
+      const auto &last_offsets = _bucket_offsets.back();
+      auto last_num_buckets = last_offsets.size() - 1;
+      auto offsets = std::vector<size_t>(last_num_buckets * _split_factor + 1);
+      offsets.back() = n;
+
+      for (size_t last_bucket_id = 0; last_bucket_id < last_num_buckets;
+           last_bucket_id++) {
+        auto last_start = last_offsets.at(last_bucket_id);
+        auto last_end = last_offsets.at(last_bucket_id + 1);
         auto last_size = last_end - last_start;
 
         auto large_bucket_size =
@@ -164,28 +661,520 @@ private:
         auto small_bucket_size = large_bucket_size - 1;
         auto num_larger_buckets = last_size - small_bucket_size * _split_factor;
 
-        parlay::parallel_for(0, num_larger_buckets, [&](auto i) {
-          auto start = last_start + i * large_bucket_size;
-          auto end = start + large_bucket_size;
-          _bucket_offsets.back().at(last_bucket_id * _split_factor + i) = start;
-          _spatial_indices.back().at(last_bucket_id * _split_factor + i) =
-              create_index(_filter_values, start, end, _points.get(),
-                           build_params);
-          // std::cout << "start = " << start << ", end = " << end << std::endl;
-        });
+        for (size_t i = 0; i < _split_factor; i++) {
+          auto start = i < num_larger_buckets
+                           ? last_start + i * large_bucket_size
+                           : last_start + num_larger_buckets * large_bucket_size +
+                                 (i - num_larger_buckets) * small_bucket_size;
+          offsets.at(last_bucket_id * _split_factor + i) = start;
+        }
+      }
 
-        parlay::parallel_for(num_larger_buckets, _split_factor, [&](auto i) {
-          auto start = last_start + num_larger_buckets * large_bucket_size +
-                       (i - num_larger_buckets) * small_bucket_size;
-          auto end = start + small_bucket_size;
-          _bucket_offsets.back().at(last_bucket_id * _split_factor + i) = start;
-          _spatial_indices.back().at(last_bucket_id * _split_factor + i) =
-              create_index(_filter_values, start, end, _points.get(),
-                           build_params);
-          // std::cout << "start = " << start << ", end = " << end << std::endl;
-        });
-      });
+      _bucket_offsets.push_back(std::move(offsets));
+    }
+
+    _row_degrees = std::vector<long>(_bucket_offsets.size(), build_params.R);
+    if (build_params.memory_budget > 0) {
+      plan_memory_budget(build_params.memory_budget);
+    }
+
+    // All of the blocks are allocated up front, the buckets keep pointers
+    // into them
+    if (supports_level_blocks && build_params.level_graph_blocks) {
+      _level_graphs = std::vector<parlay::sequence<index_type>>(
+          _bucket_offsets.size());
+      for (size_t row = 0; row < _level_graphs.size(); row++) {
+        _level_graphs.at(row) = parlay::sequence<index_type>(
+            n * (_row_degrees.at(row) + 1), 0);
+      }
+    }
+
+    std::vector<BucketBuildTask> tasks;
+    for (size_t row = 0; row < _bucket_offsets.size(); row++) {
+      auto num_buckets = _bucket_offsets.at(row).size() - 1;
+      _spatial_indices.push_back(std::vector<SpatialIndexPtr>(num_buckets));
+      for (size_t bucket = 0; bucket < num_buckets; bucket++) {
+        tasks.push_back({row, bucket, _bucket_offsets.at(row).at(bucket),
+                         _bucket_offsets.at(row).at(bucket + 1)});
+      }
+    }
+
+    if (!(supports_child_merge && build_params.merge_child_graphs)) {
+      run_bucket_builds(
+          tasks, build_params.verbose, [&](const BucketBuildTask &task) {
+            _spatial_indices.at(task.row).at(task.bucket) = create_index(
+                _filter_values, task.start, task.end, _points.get(),
+                row_build_params(task.row), {}, level_graph_rows(task));
+          });
+    } else {
+      // Parents are merged from their children's graphs, so the rows have to
+      // be built from the leaves up
+      for (size_t row = _bucket_offsets.size(); row-- > 0;) {
+        auto row_tasks = std::vector<BucketBuildTask>(0);
+        for (auto &task : tasks) {
+          if (task.row == row) {
+            row_tasks.push_back(task);
+          }
+        }
+        run_bucket_builds(
+            row_tasks, build_params.verbose, [&](const BucketBuildTask &task) {
+              ChildIndices children;
+              if (task.row + 1 < _bucket_offsets.size()) {
+                auto fanout = children_per_bucket(task.row);
+                for (size_t child = task.bucket * fanout;
+                     child < (task.bucket + 1) * fanout; child++) {
+                  auto child_start = _bucket_offsets.at(task.row + 1).at(child);
+                  auto child_end =
+                      _bucket_offsets.at(task.row + 1).at(child + 1);
+                  if (child_end > child_start) {
+                    children.push_back(
+                        {child_start - task.start,
+                         _spatial_indices.at(task.row + 1).at(child).get()});
+                  }
+                }
+              }
+              _spatial_indices.at(task.row).at(task.bucket) = create_index(
+                  _filter_values, task.start, task.end, _points.get(),
+                  row_build_params(task.row), children, level_graph_rows(task));
+            });
+      }
+    }
+
+    if (build_params.memory_budget > 0) {
+      print_graph_bytes();
+    }
+  }
+
+  // Bytes taken by the points, labels, label search and decoding, which
+  // every row shares
+  size_t shared_bytes() const {
+    auto n = _points->size();
+    return n * (_points->aligned_dimension() * sizeof(T) +
+                2 * sizeof(FilterType) + sizeof(index_type) + sizeof(size_t));
+  }
+
+  // Bytes taken by the graphs of a row whose buckets have the given degree
+  size_t row_graph_bytes(long degree) const {
+    return supports_snapshots
+               ? _points->size() * (degree + 1) * sizeof(index_type)
+               : 0;
+  }
+
+  // Fits the tree into budget bytes. Every row costs the same, n graph rows,
+  // so first the degree of the rows with the smallest buckets is halved, down
+  // to a quarter of R, then every other row from the bottom up is dropped,
+  // which has windows fall back to the twice as many buckets of the row
+  // below, and last the bottom rows are dropped, which raises the cutoff and
+  // leaves more to the edge scans. The root is always kept. Whatever dropping
+  // rows saves goes back into the degree of the largest buckets.
+  void plan_memory_budget(size_t budget) {
+    auto num_rows = _bucket_offsets.size();
+    auto kept = std::vector<bool>(num_rows, true);
+    long min_degree = std::max<long>(_build_params.R / 4, 1);
+
+    auto planned_bytes = [&]() {
+      size_t bytes = shared_bytes();
+      for (size_t row = 0; row < num_rows; row++) {
+        if (kept.at(row)) {
+          bytes += row_graph_bytes(_row_degrees.at(row));
+        }
+      }
+      return bytes;
+    };
+
+    for (size_t row = num_rows; row-- > 0 && planned_bytes() > budget;) {
+      while (_row_degrees.at(row) / 2 >= min_degree &&
+             planned_bytes() > budget) {
+        _row_degrees.at(row) /= 2;
+      }
+    }
+    for (long row = (long)num_rows - 2; row >= 1 && planned_bytes() > budget;
+         row -= 2) {
+      kept.at(row) = false;
+    }
+    for (size_t row = num_rows; row-- > 1 && planned_bytes() > budget;) {
+      kept.at(row) = false;
+    }
+    // Dropped rows may have freed enough to give the largest buckets back
+    // some of their degree, parents never get less than their children. The
+    // parent of a row is the kept row above it.
+    long parent_degree = _build_params.R;
+    for (size_t row = 0; row < num_rows; row++) {
+      if (!kept.at(row)) {
+        continue;
+      }
+      while (_row_degrees.at(row) * 2 <= parent_degree) {
+        _row_degrees.at(row) *= 2;
+        if (planned_bytes() > budget) {
+          _row_degrees.at(row) /= 2;
+          break;
+        }
+      }
+      parent_degree = _row_degrees.at(row);
+    }
+    if (planned_bytes() > budget) {
+      throw std::runtime_error(
+          "A memory budget of " + std::to_string(budget) +
+          " bytes is below the " + std::to_string(planned_bytes()) +
+          " bytes taken by the points and a root graph of degree " +
+          std::to_string(_row_degrees.at(0)));
+    }
+
+    std::cout << "Memory budget " << budget << " bytes, " << shared_bytes()
+              << " bytes for points and labels" << std::endl;
+    for (size_t row = 0; row < num_rows; row++) {
+      std::cout << "Row " << row << " (bucket size "
+                << _bucket_offsets.at(row).at(1) - _bucket_offsets.at(row).at(0)
+                << "): ";
+      if (kept.at(row)) {
+        std::cout << "degree " << _row_degrees.at(row) << ", estimated "
+                  << row_graph_bytes(_row_degrees.at(row)) << " bytes"
+                  << std::endl;
+      } else {
+        std::cout << "dropped" << std::endl;
+      }
+    }
+
+    for (size_t row = num_rows; row-- > 0;) {
+      if (!kept.at(row)) {
+        _bucket_offsets.erase(_bucket_offsets.begin() + row);
+        _row_degrees.erase(_row_degrees.begin() + row);
+      }
+    }
+    _cutoff = std::max<size_t>(_cutoff, _bucket_offsets.back().at(1) -
+                                            _bucket_offsets.back().at(0));
+  }
+
+  // Bytes actually taken by the bucket graphs of each row
+  void print_graph_bytes() {
+    for (size_t row = 0; row < _spatial_indices.size(); row++) {
+      size_t bytes = 0;
+      if constexpr (supports_snapshots) {
+        if (_level_graphs.empty()) {
+          for (auto &bucket : _spatial_indices.at(row)) {
+            bytes += bucket->G.size() * (bucket->G.max_degree() + 1) *
+                     sizeof(index_type);
+          }
+        } else {
+          bytes = _level_graphs.at(row).size() * sizeof(index_type);
+        }
+      }
+      std::cout << "Row " << row << ": degree " << _row_degrees.at(row) << ", "
+                << bytes << " bytes of graphs" << std::endl;
+    }
+  }
+
+  // The build parameters of the buckets in a row, which may have a smaller
+  // degree than the tree under a memory budget
+  BuildParams row_build_params(size_t row) const {
+    BuildParams row_params = _build_params;
+    row_params.R = _row_degrees.at(row);
+    return row_params;
+  }
+
+  // Number of buckets in the row below under each bucket of row, the split
+  // factor unless rows were dropped under a memory budget
+  size_t children_per_bucket(size_t row) const {
+    return (_bucket_offsets.at(row + 1).size() - 1) /
+           (_bucket_offsets.at(row).size() - 1);
+  }
+
+  // The cost model of the "auto" query method. It is calibrated by the first
+  // query that needs it rather than at build time, as timing probes slow
+  // builds and loads down and makes them depend on the load of the machine.
+  // Concurrent first callers may each calibrate one, and either is kept.
+  std::shared_ptr<const SearchCostModel> cost_model() {
+    auto model = std::atomic_load(&_cost_model);
+    if (model == nullptr) {
+      model = std::make_shared<const SearchCostModel>(calibrate_cost_model());
+      std::atomic_store(&_cost_model, model);
+    }
+    return model;
+  }
+
+  // Times bucket queries in every row, with points of the index as queries,
+  // and brute force scans over the last points, which are never expired. The
+  // model prices beam searches, so trees whose buckets do not search a graph
+  // are left uncalibrated and plan every query as fenwick.
+  SearchCostModel calibrate_cost_model() {
+    SearchCostModel model;
+    if constexpr (!has_bucket_graphs) {
+      return model;
+    }
+    using clock = std::chrono::steady_clock;
+
+    auto n = _points->size();
+    if (n == 0) {
+      return model;
+    }
+
+    QueryParams probe_params(COST_MODEL_PROBE_K, COST_MODEL_PROBE_BEAM, 1.35,
+                             10'000'000, 10'000);
+    probe_params.final_beam_multiply = 1;
+
+    model.row_beam_cost = std::vector<double>(_bucket_offsets.size(), 0);
+    for (size_t row = 0; row < _bucket_offsets.size(); row++) {
+      auto num_buckets = _bucket_offsets.at(row).size() - 1;
+      double seconds = 0;
+      size_t num_probes = 0;
+      for (size_t probe = 0; probe < COST_MODEL_PROBES_PER_ROW; probe++) {
+        auto bucket = probe * num_buckets / COST_MODEL_PROBES_PER_ROW;
+        auto start = _bucket_offsets.at(row).at(bucket);
+        auto end = _bucket_offsets.at(row).at(bucket + 1);
+        auto index = bucket_index(row, bucket);
+        // Buckets freed by expiry
+        if (end == start || index == nullptr) {
+          continue;
+        }
+        Point q = (*_points)[end - 1 - (probe * 7919) % (end - start)];
+        FilterRange range = {_filter_values[start], _filter_values[end - 1]};
+
+        auto probe_start = clock::now();
+        index->query(q, range, probe_params);
+        seconds +=
+            std::chrono::duration<double>(clock::now() - probe_start).count();
+        num_probes++;
+      }
+      if (num_probes > 0) {
+        model.row_beam_cost.at(row) =
+            seconds / (num_probes * COST_MODEL_PROBE_BEAM);
+      }
+    }
+
+    auto scan_size = std::min(n, COST_MODEL_SCAN_PROBE_SIZE);
+    double seconds = 0;
+    for (size_t probe = 0; probe < COST_MODEL_PROBES_PER_ROW; probe++) {
+      Point q = (*_points)[n - 1 - (probe * 7919) % scan_size];
+      auto probe_start = clock::now();
+      scan_edge(q, n - scan_size, n, COST_MODEL_PROBE_K);
+      seconds +=
+          std::chrono::duration<double>(clock::now() - probe_start).count();
+    }
+    model.scan_point_cost = seconds / (COST_MODEL_PROBES_PER_ROW * scan_size);
+    return model;
+  }
+
+  size_t appended_bucket_size(size_t row) const {
+    size_t bucket_size = _cutoff;
+    for (size_t i = 0; i < row; i++) {
+      bucket_size *= _split_factor;
+    }
+    return bucket_size;
+  }
+
+  // The appended points as last published, see AppendedState
+  std::shared_ptr<const AppendedState> appended_state() const {
+    return std::atomic_load(&_appended);
+  }
+
+  // Publishes a copy of the appended state without the buckets and leaves
+  // that only hold points with filter values below label. They are freed once
+  // no query holds the old state. Appended buckets are small next to the base
+  // tree and only ever freed whole.
+  void expire_appended(const AppendedState &current, FilterType label) {
+    size_t leaf_size = _cutoff;
+    auto appended = std::make_shared<AppendedState>(current);
+    appended->expired = first_greater_than_or_equal_to<FilterType>(
+        label, appended->filter_values);
+    for (size_t row = 0; row < appended->rows.size(); row++) {
+      size_t bucket_size = appended_bucket_size(row);
+      for (size_t bucket = 0; bucket < appended->rows.at(row).size() &&
+                              (bucket + 1) * bucket_size <= appended->expired;
+           bucket++) {
+        appended->rows.at(row).at(bucket).reset();
+      }
+    }
+    // Live buckets keep their own references to the leaves they span
+    for (size_t leaf = 0; leaf < appended->leaves.size() &&
+                          (leaf + 1) * leaf_size <= appended->expired;
+         leaf++) {
+      appended->leaves.at(leaf).reset();
+    }
+    std::atomic_store(&_appended,
+                      std::shared_ptr<const AppendedState>(std::move(appended)));
+  }
+
+  // The bucket a query searches, held for as long as the query runs even if
+  // expire_before swaps it out meanwhile
+  SpatialIndexPtr bucket_index(size_t row, size_t bucket) const {
+    return std::atomic_load(&_spatial_indices.at(row).at(bucket));
+  }
+
+  // Swaps the bucket's replacement, or an empty slot, in for it, and keeps the
+  // bucket until no query holds it
+  void retire_bucket(size_t row, size_t bucket, SpatialIndexPtr replacement) {
+    size_t start = _live_index_starts.at(row);
+    bool level_rows = !_level_graphs.empty() &&
+                      start == _bucket_offsets.at(row).at(bucket);
+    _retired_buckets.push_back(
+        {std::atomic_exchange(&_spatial_indices.at(row).at(bucket),
+                              std::move(replacement)),
+         row, start, _bucket_offsets.at(row).at(bucket + 1), level_rows});
+  }
+
+  // Frees the retired buckets no query holds any more, along with the level
+  // graph rows they were served from. Nothing can take a new reference to a
+  // retired bucket, so one that is only held here stays that way.
+  void release_retired_buckets() {
+    auto still_held = std::vector<RetiredBucket>(0);
+    for (auto &bucket : _retired_buckets) {
+      if (bucket.index.use_count() > 1) {
+        still_held.push_back(std::move(bucket));
+        continue;
+      }
+      bucket.index.reset();
+      if (bucket.level_rows) {
+        size_t row_size = _row_degrees.at(bucket.row) + 1;
+        release_pages(_level_graphs.at(bucket.row).data() +
+                          bucket.start * row_size,
+                      (bucket.end - bucket.start) * row_size *
+                          sizeof(index_type));
+      }
+    }
+    _retired_buckets = std::move(still_held);
+  }
+
+  // Builds the buckets over the appended points [start, start + size), which
+  // start at a leaf boundary and span whole leaves
+  AppendedIndexPtr create_appended_index(const AppendedState &appended,
+                                         size_t start, size_t size,
+                                         const AppendedChildIndices &children) {
+    size_t leaf_size = _cutoff;
+    auto leaves = std::vector<std::shared_ptr<PR>>(
+        appended.leaves.begin() + start / leaf_size,
+        appended.leaves.begin() + (start + size) / leaf_size);
+    auto subset_points = std::make_unique<AppendedRange>(
+        leaves, leaf_size, _points->size() + start, size);
+    FilterList subset_of_filter_values =
+        FilterList(appended.filter_values.begin() + start,
+                   appended.filter_values.begin() + start + size);
+
+    if constexpr (supports_appended_merge) {
+      if (!children.empty()) {
+        return std::make_unique<AppendedIndex>(std::move(subset_points),
+                                               subset_of_filter_values,
+                                               _build_params, children);
+      }
+    }
+    return std::make_unique<AppendedIndex>(
+        std::move(subset_points), subset_of_filter_values, _build_params);
+  }
+
+  // Builds a bucket for every appended leaf that has filled up, and then, row
+  // by row, a bucket above every split_factor buckets that are all sealed.
+  // appended is a state that is not published yet.
+  void seal_appended_buckets(AppendedState &appended) {
+    bool merge = supports_appended_merge && _build_params.merge_child_graphs;
+    for (size_t row = 0;; row++) {
+      size_t num_sealed =
+          row == 0 ? appended.filter_values.size() / _cutoff
+                   : appended.rows.at(row - 1).size() / _split_factor;
+      if (appended.rows.size() == row) {
+        if (num_sealed == 0) {
+          return;
+        }
+        appended.rows.emplace_back();
+      }
+      size_t num_built = appended.rows.at(row).size();
+      if (num_sealed == num_built) {
+        return;
+      }
+
+      size_t bucket_size = appended_bucket_size(row);
+      appended.rows.at(row).resize(num_sealed);
+      parlay::parallel_for(
+          num_built, num_sealed,
+          [&](size_t bucket) {
+            // Queries never start before the expired points, so a bucket
+            // that does would never be searched
+            if (bucket * bucket_size < appended.expired) {
+              return;
+            }
+            AppendedChildIndices children;
+            if (merge && row > 0) {
+              size_t child_size = appended_bucket_size(row - 1);
+              for (size_t child = 0; child < _split_factor; child++) {
+                children.push_back(
+                    {child * child_size,
+                     appended.rows.at(row - 1)
+                         .at(bucket * _split_factor + child)
+                         .get()});
+              }
+            }
+            appended.rows.at(row).at(bucket) = create_appended_index(
+                appended, bucket * bucket_size, bucket_size, children);
+          },
+          1);
+    }
+  }
+
+  // Searches the appended points in range: the largest sealed buckets that
+  // fit in the window at their alignment are queried, and whatever is left,
+  // including any part of the unsealed leaf, is brute forced
+  parlay::sequence<pid> appended_search(const AppendedState &appended,
+                                        const Point &query,
+                                        const FilterRange &range,
+                                        QueryParams query_params) {
+    size_t knn = query_params.k;
+    size_t leaf_size = _cutoff;
+    auto inclusive_start = first_greater_than_or_equal_to<FilterType>(
+        range.first, appended.filter_values);
+    auto exclusive_end = first_greater_than_or_equal_to<FilterType>(
+        range.second, appended.filter_values);
+
+    parlay::sequence<pid> frontier;
+    size_t position = inclusive_start;
+    while (position < exclusive_end) {
+      std::optional<size_t> bucket_row = std::nullopt;
+      for (size_t row = appended.rows.size(); row-- > 0;) {
+        size_t bucket_size = appended_bucket_size(row);
+        if (position % bucket_size == 0 &&
+            position + bucket_size <= exclusive_end &&
+            position / bucket_size < appended.rows.at(row).size() &&
+            appended.rows.at(row).at(position / bucket_size) != nullptr) {
+          bucket_row = row;
+          break;
+        }
+      }
+
+      if (bucket_row.has_value()) {
+        size_t bucket_size = appended_bucket_size(*bucket_row);
+        if (query_params.verbose) {
+          std::cout << "Searching appended bucket: " << position << " "
+                    << position + bucket_size << std::endl;
+        }
+        for (auto pid : appended.rows.at(*bucket_row)
+                            .at(position / bucket_size)
+                            ->query(query, range, query_params)) {
+          frontier.push_back(pid);
+        }
+        position += bucket_size;
+      } else {
+        size_t leaf = position / leaf_size;
+        size_t scan_end = std::min(exclusive_end, (leaf + 1) * leaf_size);
+        BoundedTopK top_k(knn);
+        scan_contiguous_block(query, *appended.leaves.at(leaf),
+                              position - leaf * leaf_size,
+                              scan_end - leaf * leaf_size, top_k);
+        for (auto [id, dist] : top_k.sorted()) {
+          frontier.push_back({_points->size() + leaf * leaf_size + id, dist});
+        }
+        position = scan_end;
+      }
     }
+
+    sort_and_truncate(frontier, knn);
+    return frontier;
+  }
+
+  // The rows of the level block that belong to the bucket of task, or
+  // nullptr when the buckets allocate their own graphs
+  index_type *level_graph_rows(const BucketBuildTask &task) {
+    if (_level_graphs.empty()) {
+      return nullptr;
+    }
+    return _level_graphs.at(task.row).data() +
+           task.start * (_row_degrees.at(task.row) + 1);
   }
 
   bool check_empty(const FilterRange &range) {
@@ -294,24 +1283,16 @@ private:
                              start, end};
   }
 
-  parlay::sequence<pid> fenwick_tree_search(const Point &query,
-                                            const FilterRange &range,
-                                            QueryParams query_params) {
-    if (check_empty(range)) {
-      return parlay::sequence<pid>();
-    }
-
-    size_t knn = query_params.k;
-
-    auto inclusive_start =
-        first_greater_than_or_equal_to<FilterType>(range.first, _filter_values);
-    auto exclusive_end = first_greater_than_or_equal_to<FilterType>(
-        range.second, _filter_values);
-
+  // Splits the sorted points [inclusive_start, exclusive_end) into the
+  // (row, bucket) pairs of the buckets that fenwick search queries, largest
+  // first, and the index ranges left over at the edges that it brute forces
+  void decompose_window(
+      size_t inclusive_start, size_t exclusive_end,
+      std::vector<std::pair<size_t, size_t>> &ranges_to_search,
+      std::vector<std::pair<size_t, size_t>> &edges_to_scan) {
     auto center_ranges_opt =
         find_largest_ranges_within_query_range(inclusive_start, exclusive_end);
 
-    auto ranges_to_search = std::vector<std::pair<size_t, size_t>>(0);
     std::optional<size_t> cover_inclusive_start,
         cover_exclusive_end = std::nullopt;
 
@@ -329,9 +1310,10 @@ private:
       size_t last_included_right_index = center_range.bucket_end_index - 1;
       for (size_t bucket_row = center_range.bucket_row + 1;
            bucket_row < _bucket_offsets.size(); bucket_row++) {
-        last_included_left_index *= _split_factor;
-        last_included_right_index *= _split_factor;
-        last_included_right_index += _split_factor - 1;
+        auto fanout = children_per_bucket(bucket_row - 1);
+        last_included_left_index *= fanout;
+        last_included_right_index *= fanout;
+        last_included_right_index += fanout - 1;
 
         while (last_included_left_index > 0) {
           auto next_left_bucket_start =
@@ -360,10 +1342,48 @@ private:
       }
     }
 
+    // Index ranges of points that are not covered by any searched bucket and
+    // so have to be brute forced
+    if (cover_inclusive_start.has_value() && cover_exclusive_end.has_value()) {
+      edges_to_scan.push_back({inclusive_start, *cover_inclusive_start});
+      edges_to_scan.push_back({*cover_exclusive_end, exclusive_end});
+    } else {
+      edges_to_scan.push_back({inclusive_start, exclusive_end});
+    }
+  }
+
+  parlay::sequence<pid> fenwick_tree_search(const Point &query,
+                                            const FilterRange &range,
+                                            QueryParams query_params) {
+    if (check_empty(range)) {
+      return parlay::sequence<pid>();
+    }
+
+    size_t knn = query_params.k;
+
+    auto inclusive_start =
+        _label_search.first_greater_than_or_equal_to(range.first);
+    auto exclusive_end =
+        _label_search.first_greater_than_or_equal_to(range.second);
+
+    auto ranges_to_search = std::vector<std::pair<size_t, size_t>>(0);
+    auto edges_to_scan = std::vector<std::pair<size_t, size_t>>(0);
+    decompose_window(inclusive_start, exclusive_end, ranges_to_search,
+                     edges_to_scan);
+
     if (query_params.verbose) {
       std::cout << "Query range: " << inclusive_start << " " << exclusive_end
                 << std::endl;
     }
+
+    if (query_params.intra_query_parallel) {
+      return parallel_fan_out_search(query, range, query_params,
+                                     ranges_to_search, edges_to_scan);
+    }
+
+    // ranges_to_search starts with the largest buckets, so their results give
+    // the tightest bound for the smaller buckets that follow
+    QueryParams bucket_params = query_params;
     parlay::sequence<pid> frontier;
     for (auto index_pair : ranges_to_search) {
       auto bucket_row_index = index_pair.first;
@@ -375,24 +1395,19 @@ private:
                   << _bucket_offsets.at(bucket_row_index).at(bucket_index + 1)
                   << std::endl;
       }
-      auto search_results = _spatial_indices.at(bucket_row_index)
-                                .at(bucket_index)
-                                ->query(query, range, query_params);
+      auto search_results = this->bucket_index(bucket_row_index, bucket_index)
+                                ->query(query, range, bucket_params);
       for (auto pid : search_results) {
         frontier.push_back(pid);
       }
+      if (query_params.share_distance_bound) {
+        tighten_distance_bound(frontier, bucket_params);
+      }
     }
 
-    if (cover_inclusive_start.has_value() && cover_exclusive_end.has_value()) {
-      for (size_t i = inclusive_start; i < *cover_inclusive_start; i++) {
-        frontier.push_back({i, (*_points)[i].distance(query)});
-      }
-      for (size_t i = *cover_exclusive_end; i < exclusive_end; i++) {
-        frontier.push_back({i, (*_points)[i].distance(query)});
-      }
-    } else {
-      for (size_t i = inclusive_start; i < exclusive_end; i++) {
-        frontier.push_back({i, (*_points)[i].distance(query)});
+    for (auto [edge_start, edge_end] : edges_to_scan) {
+      for (auto pid : scan_edge(query, edge_start, edge_end, knn)) {
+        frontier.push_back(pid);
       }
     }
 
@@ -400,34 +1415,67 @@ private:
     return frontier;
   }
 
-  parlay::sequence<pid>
-  optimized_postfiltering_search(const Point &query, const FilterRange &range,
-                                 QueryParams query_params) {
-
-    // if the query range is entirely outside the index range, return
-    if (check_empty(range)) {
-      return parlay::sequence<pid>();
-    }
-
+  // Low latency variant of the tail of fenwick_tree_search: every bucket query
+  // and every edge scan is forked as its own task, each part is cut down to
+  // its own top k in parallel, and only then are the parts merged. Meant for
+  // single queries or small batches where the batch level parallel_for alone
+  // leaves most cores idle.
+  parlay::sequence<pid> parallel_fan_out_search(
+      const Point &query, const FilterRange &range,
+      const QueryParams &query_params,
+      const std::vector<std::pair<size_t, size_t>> &ranges_to_search,
+      const std::vector<std::pair<size_t, size_t>> &edges_to_scan) {
     size_t knn = query_params.k;
+    size_t num_buckets = ranges_to_search.size();
+
+    auto parts = parlay::sequence<parlay::sequence<pid>>(num_buckets +
+                                                         edges_to_scan.size());
+
+    // With a shared bound the largest bucket is searched on its own first, so
+    // that all of the forked bucket searches can start from its k-th distance
+    QueryParams bucket_params = query_params;
+    size_t first_forked_part = 0;
+    if (query_params.share_distance_bound && num_buckets > 0) {
+      auto [bucket_row_index, bucket_index] = ranges_to_search[0];
+      parts[0] = this->bucket_index(bucket_row_index, bucket_index)
+                     ->query(query, range, bucket_params);
+      tighten_distance_bound(parts[0], bucket_params);
+      first_forked_part = 1;
+    }
 
-    auto inclusive_start =
-        first_greater_than_or_equal_to<FilterType>(range.first, _filter_values);
-    auto exclusive_end = first_greater_than_or_equal_to<FilterType>(
-        range.second, _filter_values);
+    parlay::parallel_for(
+        first_forked_part, parts.size(),
+        [&](size_t part) {
+          if (part < num_buckets) {
+            auto [bucket_row_index, bucket_index] = ranges_to_search[part];
+            parts[part] = this->bucket_index(bucket_row_index, bucket_index)
+                              ->query(query, range, bucket_params);
+          } else {
+            auto [edge_start, edge_end] = edges_to_scan[part - num_buckets];
+            parts[part] = scan_edge(query, edge_start, edge_end, knn);
+          }
+          sort_and_truncate(parts[part], knn);
+        },
+        1);
 
-    if (4 * (exclusive_end - inclusive_start) < _cutoff) {
-      return fenwick_tree_search(query, range, query_params);
-    }
+    auto frontier = parlay::flatten(parts);
+    sort_and_truncate(frontier, knn);
+    return frontier;
+  }
 
+  // Walks down the tree to the (row, bucket) pair of the smallest bucket
+  // containing all of the sorted points [inclusive_start, exclusive_end)
+  std::pair<size_t, size_t> smallest_containing_bucket(size_t inclusive_start,
+                                                       size_t exclusive_end) {
     size_t current_row = 0;
     size_t current_index = 0;
 
     while (current_row + 1 < _bucket_offsets.size()) {
       size_t next_row = current_row + 1;
       std::optional<size_t> next_working_index = std::nullopt;
-      for (size_t possible_next_index = current_index * _split_factor;
-           possible_next_index < current_index * _split_factor + _split_factor;
+      auto fanout = children_per_bucket(current_row);
+      for (size_t possible_next_index = current_index * fanout;
+           possible_next_index < current_index * fanout + fanout;
            possible_next_index++) {
         if (possible_next_index >= _spatial_indices.at(next_row).size()) {
           break;
@@ -446,6 +1494,32 @@ private:
       current_row = next_row;
     }
 
+    return {current_row, current_index};
+  }
+
+  parlay::sequence<pid>
+  optimized_postfiltering_search(const Point &query, const FilterRange &range,
+                                 QueryParams query_params) {
+
+    // if the query range is entirely outside the index range, return
+    if (check_empty(range)) {
+      return parlay::sequence<pid>();
+    }
+
+    size_t knn = query_params.k;
+
+    auto inclusive_start =
+        _label_search.first_greater_than_or_equal_to(range.first);
+    auto exclusive_end =
+        _label_search.first_greater_than_or_equal_to(range.second);
+
+    if (4 * (exclusive_end - inclusive_start) < _cutoff) {
+      return fenwick_tree_search(query, range, query_params);
+    }
+
+    auto [current_row, current_index] =
+        smallest_containing_bucket(inclusive_start, exclusive_end);
+
     auto bucket_start = _bucket_offsets.at(current_row).at(current_index);
     auto bucket_end = _bucket_offsets.at(current_row).at(current_index + 1);
     auto bucket_size = bucket_end - bucket_start;
@@ -465,9 +1539,8 @@ private:
       return fenwick_tree_search(query, range, query_params);
     }
 
-    return _spatial_indices.at(current_row)
-        .at(current_index)
-        ->query(query, range, query_params);
+    return bucket_index(current_row, current_index)
+        ->query(query, range, query_params, exclusive_end - inclusive_start);
   }
 
   parlay::sequence<pid> three_split_search(const Point &query,
@@ -480,57 +1553,58 @@ private:
     }
 
     auto inclusive_start =
-        first_greater_than_or_equal_to<FilterType>(range.first, _filter_values);
-    auto exclusive_end = first_greater_than_or_equal_to<FilterType>(
-        range.second, _filter_values);
+        _label_search.first_greater_than_or_equal_to(range.first);
+    auto exclusive_end =
+        _label_search.first_greater_than_or_equal_to(range.second);
 
     auto center_ranges_opt =
         find_largest_ranges_within_query_range(inclusive_start, exclusive_end);
 
-    QueryParams qp_fenwick = {query_params.k,
-                              query_params.beamSize,
-                              query_params.cut,
-                              query_params.limit,
-                              query_params.degree_limit,
-                              1,
-                              query_params.postfiltering_max_beam,
-                              query_params.min_query_to_bucket_ratio,
-                              query_params.verbose};
+    QueryParams qp_fenwick = query_params;
+    qp_fenwick.final_beam_multiply = 1;
 
     if (!center_ranges_opt.has_value()) {
       return fenwick_tree_search(query, range, qp_fenwick);
     }
 
     SequentialBuckets center_ranges = center_ranges_opt.value();
-    std::vector<parlay::sequence<pid>> frontiers;
+    parlay::sequence<pid> frontier;
     for (size_t bucket_index = center_ranges.bucket_start_index;
          bucket_index < center_ranges.bucket_end_index; bucket_index++) {
-      frontiers.push_back(_spatial_indices.at(center_ranges.bucket_row)
-                              .at(bucket_index)
-                              ->query(query, range, qp_fenwick));
+      auto search_results = this->bucket_index(center_ranges.bucket_row,
+                                               bucket_index)
+                                ->query(query, range, qp_fenwick);
+      for (auto pid : search_results) {
+        frontier.push_back(pid);
+      }
+      if (query_params.share_distance_bound) {
+        tighten_distance_bound(frontier, qp_fenwick);
+      }
     }
 
+    QueryParams qp_sides = query_params;
+    qp_sides.distance_bound = qp_fenwick.distance_bound;
+
     size_t left_space = center_ranges.start_filter_cover - inclusive_start;
     size_t right_space = exclusive_end - center_ranges.end_filter_cover;
 
     if (left_space > 0) {
       FilterRange left_range = std::make_pair(
           range.first, _filter_values[center_ranges.start_filter_cover]);
-      frontiers.push_back(
-          optimized_postfiltering_search(query, left_range, query_params));
+      for (auto pid :
+           optimized_postfiltering_search(query, left_range, qp_sides)) {
+        frontier.push_back(pid);
+      }
+      if (query_params.share_distance_bound) {
+        tighten_distance_bound(frontier, qp_sides);
+      }
     }
 
     if (right_space > 0) {
       FilterRange right_range = std::make_pair(
           _filter_values[center_ranges.end_filter_cover], range.second);
-      frontiers.push_back(
-          optimized_postfiltering_search(query, right_range, query_params));
-    }
-
-    parlay::sequence<pid> frontier;
-
-    for (auto part_frontier : frontiers) {
-      for (auto pid : part_frontier) {
+      for (auto pid :
+           optimized_postfiltering_search(query, right_range, qp_sides)) {
         frontier.push_back(pid);
       }
     }
@@ -539,6 +1613,177 @@ private:
     return frontier;
   }
 
+  // Estimated cost of fenwick_tree_search on the sorted points
+  // [inclusive_start, exclusive_end)
+  double fenwick_cost(size_t inclusive_start, size_t exclusive_end,
+                      const QueryParams &query_params,
+                      const SearchCostModel &model) {
+    auto ranges_to_search = std::vector<std::pair<size_t, size_t>>(0);
+    auto edges_to_scan = std::vector<std::pair<size_t, size_t>>(0);
+    decompose_window(inclusive_start, exclusive_end, ranges_to_search,
+                     edges_to_scan);
+
+    double cost = 0;
+    for (auto [bucket_row, bucket_index] : ranges_to_search) {
+      cost += model.postfilter_cost(bucket_row, 1, query_params);
+    }
+    for (auto [edge_start, edge_end] : edges_to_scan) {
+      cost += model.scan_cost(edge_end - edge_start);
+    }
+    return cost;
+  }
+
+  // Estimated cost of a query on the smallest bucket containing the sorted
+  // points [inclusive_start, exclusive_end)
+  double single_bucket_cost(size_t inclusive_start, size_t exclusive_end,
+                            const QueryParams &query_params,
+                            const SearchCostModel &model) {
+    auto [row, index] =
+        smallest_containing_bucket(inclusive_start, exclusive_end);
+    auto bucket_size = _bucket_offsets.at(row).at(index + 1) -
+                       _bucket_offsets.at(row).at(index);
+    return model.postfilter_cost(
+        row, (double)bucket_size / (exclusive_end - inclusive_start),
+        query_params, exclusive_end - inclusive_start);
+  }
+
+  // Estimated cost of optimized_postfiltering_search, including its fallbacks
+  // to fenwick_tree_search
+  double optimized_postfilter_cost(size_t inclusive_start, size_t exclusive_end,
+                                   const QueryParams &query_params,
+                                   const SearchCostModel &model) {
+    size_t window_size = exclusive_end - inclusive_start;
+    if (window_size == 0) {
+      return 0;
+    }
+    if (4 * window_size < _cutoff) {
+      return fenwick_cost(inclusive_start, exclusive_end, query_params, model);
+    }
+    auto [row, index] =
+        smallest_containing_bucket(inclusive_start, exclusive_end);
+    float bucket_size_to_query_size_ratio =
+        (float)(_bucket_offsets.at(row).at(index + 1) -
+                _bucket_offsets.at(row).at(index)) /
+        window_size;
+    if (query_params.min_query_to_bucket_ratio.has_value() &&
+        bucket_size_to_query_size_ratio >
+            query_params.min_query_to_bucket_ratio.value()) {
+      return fenwick_cost(inclusive_start, exclusive_end, query_params, model);
+    }
+    return single_bucket_cost(inclusive_start, exclusive_end, query_params,
+                              model);
+  }
+
+  // Estimated cost of three_split_search
+  double three_split_cost(size_t inclusive_start, size_t exclusive_end,
+                          const QueryParams &query_params,
+                          const SearchCostModel &model) {
+    auto center_ranges_opt =
+        find_largest_ranges_within_query_range(inclusive_start, exclusive_end);
+
+    QueryParams qp_fenwick = query_params;
+    qp_fenwick.final_beam_multiply = 1;
+
+    if (!center_ranges_opt.has_value()) {
+      return fenwick_cost(inclusive_start, exclusive_end, qp_fenwick, model);
+    }
+
+    SequentialBuckets center_ranges = center_ranges_opt.value();
+    double cost = (center_ranges.bucket_end_index -
+                   center_ranges.bucket_start_index) *
+                  model.postfilter_cost(center_ranges.bucket_row, 1,
+                                        qp_fenwick);
+    cost += optimized_postfilter_cost(inclusive_start,
+                                      center_ranges.start_filter_cover,
+                                      query_params, model);
+    cost += optimized_postfilter_cost(center_ranges.end_filter_cover,
+                                      exclusive_end, query_params, model);
+    return cost;
+  }
+
+  // Picks whichever of brute forcing the window, querying the smallest bucket
+  // containing it, three split and fenwick search the cost model expects to
+  // be cheapest for this window, and runs it
+  parlay::sequence<pid> planned_search(const Point &query,
+                                       const FilterRange &range,
+                                       QueryParams query_params,
+                                       const SearchCostModel &model) {
+    if (check_empty(range)) {
+      return parlay::sequence<pid>();
+    }
+
+    auto inclusive_start =
+        _label_search.first_greater_than_or_equal_to(range.first);
+    auto exclusive_end =
+        _label_search.first_greater_than_or_equal_to(range.second);
+
+    SearchPlan plan = SearchPlan::Fenwick;
+    if (exclusive_end == inclusive_start) {
+      plan = SearchPlan::BruteForce;
+    } else if (model.calibrated()) {
+      std::vector<std::pair<SearchPlan, double>> costs = {
+          {SearchPlan::BruteForce,
+           model.scan_cost(exclusive_end - inclusive_start)},
+          {SearchPlan::SingleBucket,
+           single_bucket_cost(inclusive_start, exclusive_end, query_params,
+                              model)},
+          {SearchPlan::ThreeSplit,
+           three_split_cost(inclusive_start, exclusive_end, query_params,
+                            model)},
+          {SearchPlan::Fenwick,
+           fenwick_cost(inclusive_start, exclusive_end, query_params, model)}};
+      auto cheapest = std::min_element(
+          costs.begin(), costs.end(),
+          [](auto &a, auto &b) { return a.second < b.second; });
+      plan = cheapest->first;
+
+      if (query_params.verbose) {
+        std::cout << "Query range: " << inclusive_start << " " << exclusive_end
+                  << ", estimated costs:";
+        for (auto [candidate, cost] : costs) {
+          std::cout << " " << search_plan_name(candidate) << " " << cost;
+        }
+        std::cout << ", chose " << search_plan_name(plan) << std::endl;
+      }
+    }
+
+    switch (plan) {
+    case SearchPlan::BruteForce:
+      return scan_edge(query, inclusive_start, exclusive_end, query_params.k);
+    case SearchPlan::SingleBucket: {
+      auto [row, index] =
+          smallest_containing_bucket(inclusive_start, exclusive_end);
+      return bucket_index(row, index)->query(
+          query, range, query_params, exclusive_end - inclusive_start);
+    }
+    case SearchPlan::ThreeSplit:
+      return three_split_search(query, range, query_params);
+    default:
+      return fenwick_tree_search(query, range, query_params);
+    }
+  }
+
+  // Brute forces the sorted points in [start, end), which are contiguous in
+  // _points, and returns the closest k of them
+  parlay::sequence<pid> scan_edge(const Point &query, size_t start, size_t end,
+                                  size_t k) {
+    BoundedTopK top_k(k);
+    scan_contiguous_block(query, *_points, start, end, top_k);
+    return top_k.sorted();
+  }
+
+  // Trims the frontier to its top k and, once it holds k results, lowers the
+  // distance bound in query_params to the current k-th distance
+  void tighten_distance_bound(parlay::sequence<pid> &frontier,
+                              QueryParams &query_params) {
+    size_t knn = query_params.k;
+    sort_and_truncate(frontier, knn);
+    if (knn > 0 && frontier.size() >= knn) {
+      query_params.distance_bound =
+          std::min(query_params.distance_bound, frontier[knn - 1].second);
+    }
+  }
+
   void sort_and_truncate(parlay::sequence<pid> &frontier, size_t k) {
     parlay::sort_inplace(frontier,
                          [&](auto a, auto b) { return a.second < b.second; });
@@ -0,0 +1,92 @@
+#pragma once
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+// Points whose per dimension bounds are found together by one task
+constexpr size_t QUANTIZER_BOUNDS_BLOCK = 1024;
+// Largest magnitude of a code, kept symmetric so that differences and
+// products of two codes fit the 16-bit lanes of the int8 block kernels
+constexpr float QUANTIZER_MAX_CODE = 127;
+
+/* Encodes float vectors as one int8 per dimension. Every dimension is
+ * centered on the middle of its range over the data and all of them share
+ * one scale, that of the widest dimension, so squared l2 distances between
+ * codes are the distances between the points times a constant, and inner
+ * products with a code only lose a term that is the same for every point.
+ * Either way codes rank points the way the points themselves would, up to
+ * rounding. Queries outside the range of the data are clamped. */
+struct ScalarQuantizer {
+  parlay::sequence<float> centers;
+  float inverse_scale = 1;
+  bool mips = false;
+
+  ScalarQuantizer() {}
+
+  // row(i) gives the dims values of point i of n
+  template <typename Row>
+  ScalarQuantizer(size_t n, unsigned dims, Row row, bool mips) : mips(mips) {
+    size_t num_blocks =
+        (n + QUANTIZER_BOUNDS_BLOCK - 1) / QUANTIZER_BOUNDS_BLOCK;
+    auto block_bounds = parlay::tabulate(num_blocks, [&](size_t block) {
+      parlay::sequence<float> lows(dims, std::numeric_limits<float>::max());
+      parlay::sequence<float> highs(dims, std::numeric_limits<float>::lowest());
+      size_t end = std::min(n, (block + 1) * QUANTIZER_BOUNDS_BLOCK);
+      for (size_t i = block * QUANTIZER_BOUNDS_BLOCK; i < end; i++) {
+        const float *values = row(i);
+        for (unsigned j = 0; j < dims; j++) {
+          lows[j] = std::min(lows[j], values[j]);
+          highs[j] = std::max(highs[j], values[j]);
+        }
+      }
+      return std::make_pair(lows, highs);
+    });
+
+    centers = parlay::sequence<float>(dims, 0);
+    float widest = 0;
+    for (unsigned j = 0; j < dims && n > 0; j++) {
+      float low = std::numeric_limits<float>::max();
+      float high = std::numeric_limits<float>::lowest();
+      for (auto &[lows, highs] : block_bounds) {
+        low = std::min(low, lows[j]);
+        high = std::max(high, highs[j]);
+      }
+      // Inner products are taken against the raw query, so the codes of a
+      // mips index are only scaled
+      centers[j] = mips ? 0 : (low + high) / 2;
+      widest = std::max(widest, mips ? std::max(-low, high) : (high - low) / 2);
+    }
+    inverse_scale = widest > 0 ? QUANTIZER_MAX_CODE / widest : 1;
+  }
+
+  void encode(const float *values, int8_t *codes) const {
+    for (size_t j = 0; j < centers.size(); j++) {
+      float code = std::round((values[j] - centers[j]) * inverse_scale);
+      codes[j] = (int8_t)std::clamp(code, -QUANTIZER_MAX_CODE,
+                                    QUANTIZER_MAX_CODE);
+    }
+  }
+
+  // A query's code. Inner products only need the direction of the query, so
+  // a mips query gets a scale of its own that uses the whole code range.
+  void encode_query(const float *values, int8_t *codes) const {
+    if (!mips) {
+      encode(values, codes);
+      return;
+    }
+    float largest = 0;
+    for (size_t j = 0; j < centers.size(); j++) {
+      largest = std::max(largest, std::abs(values[j]));
+    }
+    float query_scale = largest > 0 ? QUANTIZER_MAX_CODE / largest : 1;
+    for (size_t j = 0; j < centers.size(); j++) {
+      codes[j] = (int8_t)std::round(values[j] * query_scale);
+    }
+  }
+};
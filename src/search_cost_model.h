@@ -0,0 +1,94 @@
+#pragma once
+
+#include "algorithms/utils/types.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Beam width and k of the bucket queries timed at build time
+constexpr long COST_MODEL_PROBE_BEAM = 64;
+constexpr long COST_MODEL_PROBE_K = 10;
+// Queries timed per tree row, and points timed per brute force probe
+constexpr size_t COST_MODEL_PROBES_PER_ROW = 16;
+constexpr size_t COST_MODEL_SCAN_PROBE_SIZE = 1 << 14;
+
+// The ways a tree index can answer a single window query
+enum class SearchPlan { BruteForce, SingleBucket, ThreeSplit, Fenwick };
+
+inline std::string search_plan_name(SearchPlan plan) {
+  switch (plan) {
+  case SearchPlan::BruteForce:
+    return "brute_force";
+  case SearchPlan::SingleBucket:
+    return "single_bucket";
+  case SearchPlan::ThreeSplit:
+    return "three_split";
+  default:
+    return "fenwick";
+  }
+}
+
+/* Estimated seconds taken by the pieces a tree query is made of, measured
+ * when the tree is built. A bucket query is assumed to cost a per row
+ * constant times the width of the widest beam it runs, and a brute force
+ * scan a constant per point. */
+struct SearchCostModel {
+  // Seconds per unit of beam width for a query on a bucket in row i
+  std::vector<double> row_beam_cost;
+  // Seconds per point for a brute force scan
+  double scan_point_cost = 0;
+
+  bool calibrated() const { return !row_beam_cost.empty(); }
+
+  double scan_cost(size_t num_points) const {
+    return scan_point_cost * num_points;
+  }
+
+  // Cost of a doubling postfiltered query on a bucket of the given row that
+  // is blowup times larger than the part of it inside the window, following
+  // PostfilterVamanaIndex::doubling_query round for round. The first beam is
+  // the predicted one when the query is given in_window_count, and the beam
+  // then doubles while fewer than k in-window points are expected in it and
+  // the doubled beam stays under postfiltering_max_beam. If a round found
+  // enough, one last beam final_beam_multiply times wider is run. Every
+  // wider beam continues the search of the previous one, so the query costs
+  // about as much as the widest beam alone.
+  double postfilter_cost(size_t row, double blowup,
+                         const QueryParams &query_params,
+                         size_t in_window_count = 0) const {
+    double knn = query_params.k;
+    long max_beam = query_params.postfiltering_max_beam;
+    long beam = query_params.beamSize;
+    bool predicted =
+        in_window_count > 0 && query_params.predicted_beam_safety > 0;
+    if (predicted) {
+      double wanted = std::min<double>(knn, in_window_count);
+      long widest =
+          std::min<long>(std::llround(blowup * in_window_count), max_beam);
+      beam = std::clamp<long>(
+          std::ceil(wanted * blowup * query_params.predicted_beam_safety), beam,
+          std::max(beam, widest));
+    }
+
+    long widest_run = beam;
+    bool found_enough = false;
+    do {
+      widest_run = beam;
+      if ((predicted && !query_params.predicted_beam_fallback) ||
+          beam >= knn * blowup) {
+        found_enough = true;
+        break;
+      }
+      beam *= 2;
+    } while (beam < max_beam);
+    if (found_enough) {
+      widest_run = std::max<long>(
+          widest_run,
+          std::min<long>(beam * query_params.final_beam_multiply, max_beam));
+    }
+    return row_beam_cost.at(row) * widest_run;
+  }
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include "parlay/parallel.h"
+#include "parlay/primitives.h"
+#include "parlay/sequence.h"
+
+#include "algorithms/utils/beamSearch.h"
+#include "algorithms/utils/graph.h"
+#include "algorithms/utils/point_range.h"
+#include "algorithms/utils/types.h"
+
+#include "algorithms/vamana/index.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+using index_type = int32_t;
+
+/* The graphs of one row of overlapping buckets that start every
+ * segment_size points and are whole numbers of segments long. Every segment
+ * of segment_size points gets one Vamana graph of its own, and every pair of
+ * adjacent segments gets up to stitch_degree edges from each point of one to
+ * the other, found by a beam search over the other segment's graph. A bucket
+ * is then served as a view of its segments' rows, which hold the segment
+ * edges between the stitches to the previous and to the next segment, so a
+ * point's edges are stored once for the row instead of once per bucket it is
+ * in and each point is only inserted into a single graph. */
+template <typename T, typename Point> struct SegmentGraphs {
+  using PR = PointRange<T, Point>;
+  using SegmentRange = OffsetPointRange<T, Point, PR>;
+  using pid = std::pair<index_type, float>;
+
+  SegmentGraphs(PR *points, size_t segment_size, BuildParams build_params)
+      : segment_size(segment_size), max_degree(build_params.R),
+        num_points(points->size()) {
+    size_t n = points->size();
+    stitch_degree = build_params.segment_stitch_degree > 0
+                        ? build_params.segment_stitch_degree
+                        : std::max<long>(build_params.R / 4, 1);
+    row_size = row_entries(max_degree, stitch_degree);
+    owned_rows = parlay::sequence<index_type>(n * row_size, 0);
+    rows = owned_rows.begin();
+
+    size_t num_segments = (n + segment_size - 1) / segment_size;
+    std::vector<std::unique_ptr<SegmentRange>> ranges(num_segments);
+    std::vector<Graph<index_type>> graphs(num_segments);
+    parlay::parallel_for(
+        0, num_segments,
+        [&](size_t segment) {
+          size_t start = segment * segment_size;
+          size_t end = std::min(start + segment_size, n);
+          ranges[segment] = points->make_offset_range(start, end - start);
+          graphs[segment] = Graph<index_type>(build_params.R, end - start);
+          knn_index<Point, SegmentRange, index_type> I(build_params);
+          stats<index_type> BuildStats(end - start);
+          I.build_index(graphs[segment], *ranges[segment], BuildStats);
+        },
+        1);
+
+    // forward[i] holds the stitches from the points of segment i to segment
+    // i + 1 and backward[i] those back, as ids in the other segment
+    std::vector<parlay::sequence<parlay::sequence<index_type>>> forward(
+        num_segments),
+        backward(num_segments);
+    long L = build_params.merge_L > 0 ? build_params.merge_L
+                                      : std::max<long>(build_params.L / 4, 1);
+    parlay::parallel_for(
+        0, num_segments > 0 ? num_segments - 1 : 0,
+        [&](size_t segment) {
+          forward[segment] =
+              stitch(*ranges[segment], *ranges[segment + 1],
+                     graphs[segment + 1], L, build_params.alpha);
+          backward[segment] =
+              stitch(*ranges[segment + 1], *ranges[segment], graphs[segment],
+                     L, build_params.alpha);
+        },
+        1);
+
+    parlay::parallel_for(0, n, [&](size_t i) {
+      size_t segment = i / segment_size;
+      size_t local = i - segment * segment_size;
+      index_type *row = rows + i * row_size;
+      size_t filled = 3;
+      auto append = [&](auto &&edges, size_t count, size_t offset) {
+        for (size_t j = 0; j < count; j++) {
+          row[filled++] = edges[j] + offset;
+        }
+      };
+
+      if (segment > 0) {
+        auto &edges = backward[segment - 1][local];
+        row[0] = edges.size();
+        append(edges, edges.size(), (segment - 1) * segment_size);
+      }
+      auto edges = graphs[segment][local];
+      row[1] = edges.size();
+      append(edges, edges.size(), segment * segment_size);
+      if (segment + 1 < num_segments) {
+        auto &next = forward[segment][local];
+        row[2] = next.size();
+        append(next, next.size(), (segment + 1) * segment_size);
+      }
+    });
+  }
+
+  // Serves the num_points rows of a snapshot in place, which the caller
+  // keeps alive
+  SegmentGraphs(size_t num_points, size_t segment_size, long max_degree,
+                long stitch_degree, index_type *rows)
+      : segment_size(segment_size), max_degree(max_degree),
+        stitch_degree(stitch_degree), num_points(num_points),
+        row_size(row_entries(max_degree, stitch_degree)), rows(rows) {}
+
+  // The graph of the bucket holding the sorted points [start, end), where
+  // start is a multiple of segment_size
+  Graph<index_type> bucket_graph(size_t start, size_t end) {
+    return Graph<index_type>(max_graph_degree(), end - start,
+                             rows + start * row_size, row_size, segment_size,
+                             start);
+  }
+
+  long max_graph_degree() const { return max_degree + 2 * stitch_degree; }
+
+  long segment_stitch_degree() const { return stitch_degree; }
+
+  // The rows of every point, as a snapshot stores them
+  const index_type *data() const { return rows; }
+  size_t num_entries() const { return num_points * row_size; }
+
+  // Entries in the row of a point: the three edge counts and room for the
+  // segment edges and the stitches either way
+  static size_t row_entries(long max_degree, long stitch_degree) {
+    return 3 + max_degree + 2 * stitch_degree;
+  }
+
+private:
+  size_t segment_size;
+  long max_degree;
+  long stitch_degree;
+  size_t num_points;
+  size_t row_size;
+  parlay::sequence<index_type> owned_rows;
+  index_type *rows;
+
+  // For every point of from, the up to stitch_degree edges into to that
+  // robustPrune would keep out of the nodes a beam search over to's graph
+  // visits
+  parlay::sequence<parlay::sequence<index_type>>
+  stitch(SegmentRange &from, SegmentRange &to, Graph<index_type> &to_graph,
+         long L, double alpha) {
+    return parlay::tabulate(from.size(), [&](size_t i) {
+      // An id of -1 keeps beam_search from taking the point for one of to's
+      Point p = Point(from[i].get(), from.dimension(),
+                      from.aligned_dimension(), -1);
+      QueryParams QP((long)0, L, (double)0.0, (long)to.size(),
+                     (long)to_graph.max_degree());
+      parlay::sequence<index_type> starts = {0};
+      auto visited = beam_search<Point, SegmentRange, index_type>(
+                         p, to_graph, to, starts, QP)
+                         .first.second;
+      std::sort(visited.begin(), visited.end(),
+                [](const pid &a, const pid &b) { return a.second < b.second; });
+
+      parlay::sequence<index_type> kept;
+      for (size_t j = 0;
+           j < visited.size() && (long)kept.size() < stitch_degree; j++) {
+        index_type candidate = visited[j].first;
+        bool pruned = std::any_of(kept.begin(), kept.end(), [&](index_type k) {
+          return alpha * to[k].distance(to[candidate]) <= visited[j].second;
+        });
+        if (!pruned) {
+          kept.push_back(candidate);
+        }
+      }
+      return kept;
+    });
+  }
+};
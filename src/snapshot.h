@@ -0,0 +1,307 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "algorithms/utils/types.h"
+
+constexpr char SNAPSHOT_MAGIC[8] = {'W', 'S', 'T', 'S', 'N', 'A', 'P', '\0'};
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+// Every section starts at a multiple of this many bytes, so that the points
+// keep the alignment PointRange gives them when the file is mapped
+constexpr uint64_t SNAPSHOT_ALIGNMENT = 64;
+
+enum class SnapshotKind : uint32_t {
+  RangeFilterTree = 1,
+  SuperOptimizedPostfilterTree = 2
+};
+
+// The boolean BuildParams a snapshot keeps, one bit each
+enum class SnapshotBuildFlag : uint32_t {
+  MergeChildGraphs = 1 << 0,
+  LevelGraphBlocks = 1 << 1,
+  WindowEntryPoints = 1 << 2,
+  LabelSortedPoints = 1 << 3,
+  QuantizedScan = 1 << 4
+};
+
+/* The fixed size start of a tree snapshot. The rest of the file is made of
+ * the sections it points to, each holding plain arrays:
+ *   decoding:      num_points uint64, sorted id -> original id
+ *   filter values: num_points filter values, sorted
+ *   points:        num_points rows of aligned_dims values, sorted
+ *   geometry:      per row, a uint64 count followed by that many uint64,
+ *                  whose meaning depends on the kind of tree
+ *   graphs:        per row and then per bucket, the bucket's size rows of
+ *                  max_degree + 1 index_type, empty if max_degree is 0.
+ *                  Rows whose buckets share segment graphs are left out.
+ *   entry points:  per row and then per bucket, a uint64 count followed by
+ *                  that many of the bucket's entry points, empty if
+ *                  max_degree is 0
+ *   segments:      per row below row 0, if segment_stitch_degree is set, the
+ *                  row's num_points segment graph rows of
+ *                  3 + max_degree + 2 * segment_stitch_degree index_type */
+struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t kind;
+  uint32_t value_size;
+  uint32_t filter_size;
+  uint64_t num_points;
+  uint32_t dims;
+  uint32_t aligned_dims;
+  int64_t cutoff;
+  double split_factor;
+  double shift_factor;
+  // Build parameters of the buckets, max_degree is 0 without graphs. They
+  // are kept so that buckets rebuilt after a load, by appends or expiry, are
+  // built the way the saved ones were.
+  int64_t max_degree;
+  int64_t beam_width;
+  double alpha;
+  int64_t merge_beam_width;
+  uint64_t memory_budget;
+  // SnapshotBuildFlag bits
+  uint32_t build_flags;
+  // Stitch edges per point of the segment graphs that the buckets below row
+  // 0 share, 0 if every bucket has a graph of its own
+  int64_t segment_stitch_degree;
+  uint64_t num_rows;
+  // Byte offsets of the sections from the start of the file
+  uint64_t decoding_offset;
+  uint64_t filter_values_offset;
+  uint64_t points_offset;
+  uint64_t geometry_offset;
+  uint64_t graphs_offset;
+  uint64_t entry_points_offset;
+  uint64_t segment_graphs_offset;
+};
+
+// Fills in the build parameters of header, except for max_degree and
+// segment_stitch_degree, which depend on the tree
+inline void write_snapshot_build_params(SnapshotHeader &header,
+                                        const BuildParams &build_params) {
+  header.beam_width = build_params.L;
+  header.alpha = build_params.alpha;
+  header.merge_beam_width = build_params.merge_L;
+  header.memory_budget = build_params.memory_budget;
+  std::pair<bool, SnapshotBuildFlag> flags[] = {
+      {build_params.merge_child_graphs, SnapshotBuildFlag::MergeChildGraphs},
+      {build_params.level_graph_blocks, SnapshotBuildFlag::LevelGraphBlocks},
+      {build_params.window_entry_points, SnapshotBuildFlag::WindowEntryPoints},
+      {build_params.label_sorted_points, SnapshotBuildFlag::LabelSortedPoints},
+      {build_params.quantized_scan, SnapshotBuildFlag::QuantizedScan}};
+  header.build_flags = 0;
+  for (auto &[set, flag] : flags) {
+    if (set) {
+      header.build_flags |= static_cast<uint32_t>(flag);
+    }
+  }
+}
+
+// The build parameters written by write_snapshot_build_params
+inline BuildParams snapshot_build_params(const SnapshotHeader &header) {
+  auto flag_set = [&](SnapshotBuildFlag flag) {
+    return (header.build_flags & static_cast<uint32_t>(flag)) != 0;
+  };
+  BuildParams build_params(header.max_degree, header.beam_width,
+                           header.alpha);
+  build_params.merge_L = header.merge_beam_width;
+  build_params.memory_budget = header.memory_budget;
+  build_params.merge_child_graphs =
+      flag_set(SnapshotBuildFlag::MergeChildGraphs);
+  build_params.level_graph_blocks =
+      flag_set(SnapshotBuildFlag::LevelGraphBlocks);
+  build_params.window_entry_points =
+      flag_set(SnapshotBuildFlag::WindowEntryPoints);
+  build_params.label_sorted_points =
+      flag_set(SnapshotBuildFlag::LabelSortedPoints);
+  build_params.quantized_scan = flag_set(SnapshotBuildFlag::QuantizedScan);
+  build_params.share_segment_graphs = header.segment_stitch_degree > 0;
+  build_params.segment_stitch_degree = header.segment_stitch_degree;
+  return build_params;
+}
+
+/* Writes a snapshot: the header is reserved up front and filled in last,
+ * once the offsets of all of the sections are known */
+struct SnapshotWriter {
+  std::ofstream writer;
+  uint64_t position = 0;
+
+  SnapshotWriter(const std::string &path)
+      : writer(path, std::ios::binary | std::ios::out | std::ios::trunc) {
+    if (!writer.is_open()) {
+      throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    SnapshotHeader empty;
+    std::memset(&empty, 0, sizeof(empty));
+    write(&empty, sizeof(empty));
+  }
+
+  // Starts a new section at the next aligned offset and returns that offset
+  uint64_t start_section() {
+    uint64_t padding =
+        (SNAPSHOT_ALIGNMENT - position % SNAPSHOT_ALIGNMENT) %
+        SNAPSHOT_ALIGNMENT;
+    const char zeros[SNAPSHOT_ALIGNMENT] = {};
+    write(zeros, padding);
+    return position;
+  }
+
+  void write(const void *data, uint64_t bytes) {
+    writer.write(static_cast<const char *>(data), bytes);
+    position += bytes;
+  }
+
+  void finish(SnapshotHeader header) {
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    writer.seekp(0);
+    writer.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    writer.close();
+    if (writer.fail()) {
+      throw std::runtime_error("Failed to write snapshot");
+    }
+  }
+};
+
+/* A snapshot mapped into memory. The mapping is private and writable, so the
+ * points and graphs can be served in place as mutable views while the file
+ * itself is never modified. */
+struct MappedSnapshot {
+  char *base = nullptr;
+  size_t size = 0;
+
+  MappedSnapshot(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+      throw std::runtime_error("Could not open snapshot " + path);
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(SnapshotHeader)) {
+      close(fd);
+      throw std::runtime_error(path + " is too small to be a snapshot");
+    }
+    size = sb.st_size;
+    void *mapped =
+        mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("Could not map snapshot " + path);
+    }
+    base = static_cast<char *>(mapped);
+
+    try {
+      check_version(path);
+    } catch (...) {
+      munmap(base, size);
+      throw;
+    }
+  }
+
+  ~MappedSnapshot() {
+    if (base != nullptr) {
+      munmap(base, size);
+    }
+  }
+
+  MappedSnapshot(const MappedSnapshot &) = delete;
+  MappedSnapshot &operator=(const MappedSnapshot &) = delete;
+
+  const SnapshotHeader &header() const {
+    return *reinterpret_cast<const SnapshotHeader *>(base);
+  }
+
+  void check_version(const std::string &path) const {
+    if (std::memcmp(header().magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) !=
+        0) {
+      throw std::runtime_error(path + " is not a tree snapshot");
+    }
+    if (header().version != SNAPSHOT_VERSION) {
+      throw std::runtime_error(path + " has snapshot version " +
+                               std::to_string(header().version) +
+                               ", expected " +
+                               std::to_string(SNAPSHOT_VERSION));
+    }
+  }
+
+  // The count values of an array of type V starting offset bytes in
+  template <typename V> V *at(uint64_t offset, uint64_t count) {
+    if (offset + count * sizeof(V) > size) {
+      throw std::runtime_error("Snapshot section runs past the end of file");
+    }
+    return reinterpret_cast<V *>(base + offset);
+  }
+
+  // Checks that the snapshot holds a tree of the given kind and types
+  void check_layout(SnapshotKind kind, size_t value_size, size_t filter_size,
+                    bool with_graphs) const {
+    if (header().kind != static_cast<uint32_t>(kind)) {
+      throw std::runtime_error("Snapshot holds a different kind of tree");
+    }
+    if (header().value_size != value_size ||
+        header().filter_size != filter_size) {
+      throw std::runtime_error(
+          "Snapshot point or filter value type does not match");
+    }
+    if ((header().max_degree > 0) != with_graphs) {
+      throw std::runtime_error(
+          "Snapshot bucket index type does not match this tree");
+    }
+  }
+
+  // Reads the geometry section back into one vector per row
+  std::vector<std::vector<uint64_t>> geometry() {
+    std::vector<std::vector<uint64_t>> rows;
+    uint64_t offset = header().geometry_offset;
+    for (uint64_t row = 0; row < header().num_rows; row++) {
+      uint64_t count = *at<uint64_t>(offset, 1);
+      uint64_t *values = at<uint64_t>(offset + sizeof(uint64_t), count);
+      rows.push_back(std::vector<uint64_t>(values, values + count));
+      offset += (count + 1) * sizeof(uint64_t);
+    }
+    return rows;
+  }
+
+  // Reads back a list written by write_snapshot_list at offset, and moves
+  // offset past it. The values are copied out, so they need not be aligned.
+  template <typename V> std::vector<V> list(uint64_t &offset) {
+    uint64_t count = *at<uint64_t>(offset, 1);
+    offset += sizeof(uint64_t);
+    std::vector<V> values(count);
+    if (count > 0) {
+      std::memcpy(values.data(), at<char>(offset, count * sizeof(V)),
+                  count * sizeof(V));
+    }
+    offset += count * sizeof(V);
+    return values;
+  }
+};
+
+// Writes the number of values followed by the values themselves
+template <typename V>
+void write_snapshot_list(SnapshotWriter &writer, const std::vector<V> &values) {
+  uint64_t count = values.size();
+  writer.write(&count, sizeof(count));
+  writer.write(values.data(), count * sizeof(V));
+}
+
+// Writes one row per entry of rows to the geometry section
+inline void
+write_snapshot_geometry(SnapshotWriter &writer,
+                        const std::vector<std::vector<uint64_t>> &rows) {
+  for (auto &row : rows) {
+    write_snapshot_list(writer, row);
+  }
+}
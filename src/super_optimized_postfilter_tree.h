@@ -11,14 +11,22 @@
 #include <chrono>
 #include <cstdint>
 #include <limits>
+#include <map>
 #include <memory>
+#include <random>
+#include <string>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 #include "pybind11/numpy.h"
 
 #include "postfilter_vamana.h"
 #include "prefiltering.h"
+#include "label_search.h"
+#include "segment_graphs.h"
+#include "snapshot.h"
+#include "super_tree_tuning.h"
 
 #include "tree_utils.h"
 
@@ -30,10 +38,11 @@ struct SuperOptimizedPostfilterTree {
   using pid = std::pair<index_type, float>;
 
   using PR = PointRange<T, Point>;
-  using SubsetRange = SubsetPointRange<T, Point>;
-  using SubsetRangePtr = std::unique_ptr<SubsetRange>;
+  // Every bucket is a contiguous run of the sorted points
+  using BucketRange = OffsetPointRange<T, Point>;
+  using BucketRangePtr = std::unique_ptr<BucketRange>;
 
-  using SpatialIndex = RangeSpatialIndex<T, Point, SubsetRange>;
+  using SpatialIndex = RangeSpatialIndex<T, Point, BucketRange>;
   using SpatialIndexPtr = std::unique_ptr<SpatialIndex>;
 
   using FilterRange = std::pair<FilterType, FilterType>;
@@ -56,6 +65,272 @@ struct SuperOptimizedPostfilterTree {
             split_factor, shift_factor, build_params);
   }
 
+  // Builds the tree with the split and shift factors that tune_super_tree_factors
+  // picks for a worst blowup of target_blowup, bucket size over window size,
+  // with the buckets holding at most max_index_multiple times n points
+  static SuperOptimizedPostfilterTree
+  tuned(py::array_t<T> points, py::array_t<FilterType> filter_values,
+        int32_t cutoff, double max_index_multiple, double target_blowup,
+        BuildParams build_params) {
+    py::buffer_info points_buf = points.request();
+    if (points_buf.ndim != 2) {
+      throw std::runtime_error("points numpy array must be 2-dimensional");
+    }
+    size_t n = points_buf.shape[0];
+    bool share_segments =
+        supports_segment_graphs && build_params.share_segment_graphs;
+    auto factors = tune_super_tree_factors(n, cutoff, max_index_multiple,
+                                           target_blowup, share_segments);
+    std::cout << "Tuned split factor " << factors.split_factor
+              << ", shift factor " << factors.shift_factor << std::endl;
+    SuperTreeGeometry(
+        n, cutoff, factors.split_factor, factors.shift_factor,
+        share_segments ? super_tree_segments_per_bucket(factors.shift_factor)
+                       : 0)
+        .print();
+    return SuperOptimizedPostfilterTree(points, filter_values, cutoff,
+                                        factors.split_factor,
+                                        factors.shift_factor, build_params);
+  }
+
+  // The predicted worst blowup of the geometry and the blowup the tree
+  // achieves on num_windows random windows, whose sizes are log uniform
+  // between what the deepest row guarantees to contain and n
+  std::map<std::string, double> blowup_distribution(size_t num_windows) {
+    SuperTreeGeometry geometry(_filter_values.size(), _cutoff, _split_factor,
+                               _shift_factor, segments_per_bucket());
+    size_t n = _filter_values.size();
+    size_t smallest = geometry.guaranteed_window(geometry.num_rows() - 1) + 1;
+
+    std::map<std::string, double> distribution;
+    distribution["predicted_worst"] = geometry.worst_blowup();
+    distribution["index_multiple"] = geometry.index_multiple();
+    if (smallest > n || num_windows == 0) {
+      return distribution;
+    }
+
+    auto blowups = parlay::tabulate(num_windows, [&](size_t i) {
+      std::mt19937_64 rng(i);
+      double log_size = std::uniform_real_distribution<double>(
+          std::log(smallest), std::log(n))(rng);
+      size_t window_size =
+          std::clamp<size_t>(std::exp(log_size), smallest, n);
+      size_t start = std::uniform_int_distribution<size_t>(
+          0, n - window_size)(rng);
+      auto [row, bucket] =
+          smallest_containing_bucket(start, start + window_size);
+      return (double)(bucket_end(row, bucket) - bucket_start(row, bucket)) /
+             window_size;
+    });
+    parlay::sort_inplace(blowups);
+    for (auto [name, quantile] :
+         std::vector<std::pair<std::string, double>>{
+             {"p50", 0.5}, {"p90", 0.9}, {"p99", 0.99}}) {
+      distribution[name] = blowups[(size_t)(quantile * (num_windows - 1))];
+    }
+    distribution["max"] = blowups.back();
+    distribution["mean"] = parlay::reduce(blowups) / num_windows;
+    return distribution;
+  }
+
+  // Writes the whole index, with its sorted points, labels, bucket layout
+  // and bucket graphs, to a single snapshot file that load maps back
+  void save(const std::string &path) {
+    SnapshotWriter writer(path);
+    SnapshotHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.kind =
+        static_cast<uint32_t>(SnapshotKind::SuperOptimizedPostfilterTree);
+    header.value_size = sizeof(T);
+    header.filter_size = sizeof(FilterType);
+    header.num_points = _points->size();
+    header.dims = _points->dimension();
+    header.aligned_dims = _points->aligned_dimension();
+    header.cutoff = _cutoff;
+    header.split_factor = _split_factor;
+    header.shift_factor = _shift_factor;
+    header.max_degree = supports_snapshots ? _build_params.R : 0;
+    write_snapshot_build_params(header, _build_params);
+    header.num_rows = _bucket_sizes.size();
+
+    header.decoding_offset = writer.start_section();
+    auto decoding = parlay::map(_sorted_index_to_original_point_id,
+                                [](size_t i) { return (uint64_t)i; });
+    writer.write(decoding.data(), decoding.size() * sizeof(uint64_t));
+
+    header.filter_values_offset = writer.start_section();
+    writer.write(_filter_values.data(),
+                 _filter_values.size() * sizeof(FilterType));
+
+    header.points_offset = writer.start_section();
+    if (_points->size() > 0) {
+      writer.write((*_points)[0].get(),
+                   _points->size() * _points->aligned_dimension() * sizeof(T));
+    }
+
+    // Per row, the bucket size, the shift between buckets and the number of
+    // buckets
+    header.geometry_offset = writer.start_section();
+    auto geometry = std::vector<std::vector<uint64_t>>(0);
+    for (size_t row = 0; row < _bucket_sizes.size(); row++) {
+      geometry.push_back({_bucket_sizes.at(row), _bucket_shifts.at(row),
+                          _spatial_indices.at(row).size()});
+    }
+    write_snapshot_geometry(writer, geometry);
+
+    // Buckets that are views of shared segment graphs are stored as the
+    // segment graph rows of their row instead
+    header.graphs_offset = writer.start_section();
+    if constexpr (supports_snapshots) {
+      for (size_t row = 0; row < _spatial_indices.size(); row++) {
+        if (_segment_graphs.at(row) != nullptr) {
+          continue;
+        }
+        for (auto &bucket : _spatial_indices.at(row)) {
+          auto rows = bucket->packed_graph();
+          writer.write(rows.data(), rows.size() * sizeof(index_type));
+        }
+      }
+    }
+
+    header.entry_points_offset = writer.start_section();
+    if constexpr (supports_snapshots) {
+      for (auto &row : _spatial_indices) {
+        for (auto &bucket : row) {
+          write_snapshot_list(writer, bucket->entry_points);
+        }
+      }
+    }
+
+    header.segment_graphs_offset = writer.start_section();
+    for (auto &segment_graphs : _segment_graphs) {
+      if (segment_graphs != nullptr) {
+        header.segment_stitch_degree = segment_graphs->segment_stitch_degree();
+        writer.write(segment_graphs->data(),
+                     segment_graphs->num_entries() * sizeof(index_type));
+      }
+    }
+
+    writer.finish(header);
+  }
+
+  // Maps a snapshot written by save. The points and bucket graphs are served
+  // from the mapping in place, only the labels are copied.
+  static SuperOptimizedPostfilterTree load(const std::string &path) {
+    auto snapshot = std::make_shared<MappedSnapshot>(path);
+    snapshot->check_layout(SnapshotKind::SuperOptimizedPostfilterTree,
+                           sizeof(T), sizeof(FilterType), supports_snapshots);
+    const SnapshotHeader &header = snapshot->header();
+    size_t n = header.num_points;
+
+    SuperOptimizedPostfilterTree index;
+    index._snapshot = snapshot;
+    index._cutoff = header.cutoff;
+    index._split_factor = header.split_factor;
+    index._shift_factor = header.shift_factor;
+    // The buckets get their entry points from the snapshot below, rather
+    // than finding them again
+    auto build_params = snapshot_build_params(header);
+    index._build_params = build_params;
+    index._build_params.window_entry_points = false;
+    if (index._build_params.share_segment_graphs && !supports_segment_graphs) {
+      throw std::runtime_error(
+          "Snapshot bucket index type does not match this tree");
+    }
+
+    auto decoding = snapshot->at<uint64_t>(header.decoding_offset, n);
+    index._sorted_index_to_original_point_id =
+        parlay::sequence<size_t>(decoding, decoding + n);
+    auto filter_values =
+        snapshot->at<FilterType>(header.filter_values_offset, n);
+    index._filter_values = FilterList(filter_values, filter_values + n);
+    index._label_search = LabelSearchIndex<FilterType>(index._filter_values);
+
+    index._points = std::make_shared<PR>(
+        snapshot->at<T>(header.points_offset, n * header.aligned_dims), n,
+        header.dims, snapshot);
+    if (index._points->aligned_dimension() != header.aligned_dims) {
+      throw std::runtime_error("Snapshot point rows are padded differently");
+    }
+
+    for (auto &row_geometry : snapshot->geometry()) {
+      index._bucket_sizes.push_back(row_geometry.at(0));
+      index._bucket_shifts.push_back(row_geometry.at(1));
+      index._spatial_indices.push_back(
+          std::vector<SpatialIndexPtr>(row_geometry.at(2)));
+    }
+
+    // Rows below row 0 whose buckets share segment graphs are served from
+    // the mapped segment graph rows
+    size_t num_rows = index._spatial_indices.size();
+    size_t num_segment_rows = index.segments_per_bucket() > 0 ? num_rows : 1;
+    index._segment_graphs.resize(num_rows);
+    if constexpr (supports_segment_graphs) {
+      uint64_t segment_offset = header.segment_graphs_offset;
+      size_t num_entries =
+          n * SegmentGraphs<T, Point>::row_entries(
+                  header.max_degree, header.segment_stitch_degree);
+      for (size_t row = 1; row < num_segment_rows; row++) {
+        index._segment_graphs.at(row) =
+            std::make_unique<SegmentGraphs<T, Point>>(
+                n, index._bucket_shifts.at(row), header.max_degree,
+                header.segment_stitch_degree,
+                snapshot->at<index_type>(segment_offset, num_entries));
+        segment_offset += num_entries * sizeof(index_type);
+        index.serve_segment_views(row);
+      }
+    }
+
+    // Bucket graphs follow each other row by row, each bucket taking one
+    // graph row per point
+    std::vector<BucketBuildTask> tasks;
+    std::vector<uint64_t> graph_offsets;
+    uint64_t graph_offset = header.graphs_offset;
+    for (size_t row = 0; row < index._spatial_indices.size(); row++) {
+      if (index._segment_graphs.at(row) != nullptr) {
+        continue;
+      }
+      for (size_t bucket = 0; bucket < index._spatial_indices.at(row).size();
+           bucket++) {
+        auto start = index.bucket_start(row, bucket);
+        auto end = index.bucket_end(row, bucket);
+        tasks.push_back({row, bucket, start, end});
+        graph_offsets.push_back(graph_offset);
+        graph_offset +=
+            (end - start) * (header.max_degree + 1) * sizeof(index_type);
+      }
+    }
+
+    parlay::parallel_for(0, tasks.size(), [&](size_t i) {
+      auto &task = tasks[i];
+      index_type *graph_rows = nullptr;
+      if constexpr (supports_snapshots) {
+        graph_rows = snapshot->at<index_type>(
+            graph_offsets[i],
+            (task.end - task.start) * (header.max_degree + 1));
+      }
+      index._spatial_indices.at(task.row).at(task.bucket) =
+          load_index(index._filter_values, task.start, task.end,
+                     index._points.get(), index._build_params, graph_rows);
+    });
+
+    // Entry points are restored rather than found again, which would read
+    // every point of every bucket
+    if constexpr (supports_snapshots) {
+      uint64_t entry_points_offset = header.entry_points_offset;
+      for (auto &row : index._spatial_indices) {
+        for (auto &bucket : row) {
+          bucket->entry_points =
+              snapshot->list<typename SpatialIndex::EntryPoint>(
+                  entry_points_offset);
+        }
+      }
+    }
+    index._build_params = build_params;
+
+    return index;
+  }
+
   /* the bounds here are inclusive */
   NeighborsAndDistances batch_search(
       py::array_t<T, py::array::c_style | py::array::forcecast> &queries,
@@ -65,13 +340,36 @@ struct SuperOptimizedPostfilterTree {
     py::array_t<unsigned int> ids({num_queries, knn});
     py::array_t<float> dists({num_queries, knn});
 
-    parlay::parallel_for(0, num_queries, [&](auto i) {
+    // Every bucket of the batch is resolved in one pass before any graph is
+    // searched
+    auto resolve_start = std::chrono::high_resolution_clock::now();
+    auto windows = label_windows(filters, num_queries);
+    auto buckets = smallest_containing_buckets(windows);
+    if (query_params.verbose) {
+      std::cout << "Time to find buckets: "
+                << std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::high_resolution_clock::now() -
+                       resolve_start)
+                       .count()
+                << "ns for " << num_queries << " queries" << std::endl;
+    }
+
+    auto order = parlay::tabulate(num_queries, [](size_t i) { return i; });
+    if (query_params.reorder_by_bucket) {
+      order = order_queries_by_bucket(
+          num_queries, [&](size_t i) { return buckets[i]; });
+    }
+
+    parlay::parallel_for(0, num_queries, [&](auto position) {
+      auto i = order[position];
       Point q = Point(queries.data(i), _points->dimension(),
                       _points->aligned_dimension(), i);
       FilterRange filter = filters[i];
 
       parlay::sequence<pid> results;
-      results = super_optimized_postfiltering_search(q, filter, query_params);
+      results = super_optimized_postfiltering_search(
+          q, filter, buckets[i], windows[i].second - windows[i].first,
+          query_params);
       for (auto j = 0; j < knn; j++) {
         if (j < results.size()) {
           ids.mutable_at(i, j) =
@@ -94,6 +392,8 @@ private:
   parlay::sequence<size_t> _sorted_index_to_original_point_id;
 
   FilterList _filter_values;
+  // Lower bound searches over _filter_values
+  LabelSearchIndex<FilterType> _label_search;
 
   int32_t _cutoff;
 
@@ -101,28 +401,122 @@ private:
 
   float _split_factor, _shift_factor;
 
+  BuildParams _build_params;
+
+  // The mapped file a loaded index serves its points and graphs from
+  std::shared_ptr<MappedSnapshot> _snapshot;
+
+  // Per row, the segment graphs its buckets are views of, if they share them
+  std::vector<std::unique_ptr<SegmentGraphs<T, Point>>> _segment_graphs;
+
+  // Already built buckets inside a new bucket, each with the offset of its
+  // first point in the new bucket
+  using ChildIndices = std::vector<std::pair<size_t, SpatialIndex *>>;
+
+  static constexpr bool supports_child_merge =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, const ChildIndices &>;
+
+  static constexpr bool supports_snapshots =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, PrebuiltGraph>;
+
+  static constexpr bool supports_segment_graphs =
+      std::is_constructible_v<SpatialIndex, BucketRangePtr &&, FilterList,
+                              BuildParams, Graph<index_type>>;
+
+  // Buckets below row 0 are this many segments of one shift each when they
+  // share segment graphs, and 0 otherwise
+  size_t segments_per_bucket() const {
+    if (!supports_segment_graphs || !_build_params.share_segment_graphs) {
+      return 0;
+    }
+    return super_tree_segments_per_bucket(_shift_factor);
+  }
+
+  // Recreates a bucket of a loaded snapshot, serving its graph from
+  // graph_rows if the index type has one
+  static SpatialIndexPtr load_index(FilterList &filter_values, size_t start,
+                                    size_t end, PR *points,
+                                    BuildParams build_params,
+                                    index_type *graph_rows) {
+    if constexpr (supports_snapshots) {
+      return std::make_unique<SpatialIndex>(
+          points->make_offset_range(start, end - start),
+          FilterList(filter_values.begin() + start,
+                     filter_values.begin() + end),
+          build_params, PrebuiltGraph(graph_rows));
+    } else {
+      return create_index(filter_values, start, end, points, build_params);
+    }
+  }
+
   static SpatialIndexPtr create_index(FilterList &filter_values, size_t start,
                                       size_t end, PR *points,
-                                      BuildParams build_params) {
-    auto filter_length = end - start;
-    parlay::sequence<int32_t> subset_of_indices = parlay::tabulate<int32_t>(
-        filter_length, [&](auto i) { return i + start; });
-    SubsetRangePtr subset_points = points->make_subset(subset_of_indices);
+                                      BuildParams build_params,
+                                      const ChildIndices &children = {}) {
+    BucketRangePtr subset_points =
+        points->make_offset_range(start, end - start);
     FilterList subset_of_filter_values =
         FilterList(filter_values.begin() + start, filter_values.begin() + end);
 
+    if constexpr (supports_child_merge) {
+      if (!children.empty()) {
+        return std::make_unique<SpatialIndex>(std::move(subset_points),
+                                              subset_of_filter_values,
+                                              build_params, children);
+      }
+    }
     return std::make_unique<SpatialIndex>(
         std::move(subset_points), subset_of_filter_values, build_params);
   }
 
+  size_t bucket_start(size_t row, size_t bucket_id) const {
+    return bucket_id * _bucket_shifts.at(row);
+  }
+
+  size_t bucket_end(size_t row, size_t bucket_id) const {
+    return std::min(bucket_start(row, bucket_id) + _bucket_sizes.at(row),
+                    _filter_values.size());
+  }
+
+  // Greedily picks non overlapping buckets of the next row that lie entirely
+  // inside [start, end). Rows overlap, so these need not cover all of it.
+  ChildIndices find_children(size_t row, size_t start, size_t end) {
+    ChildIndices children;
+    if (row + 1 >= _spatial_indices.size()) {
+      return children;
+    }
+    size_t child_row = row + 1;
+    size_t child_shift = _bucket_shifts.at(child_row);
+    size_t cursor = start;
+    for (size_t child = (start + child_shift - 1) / child_shift;
+         child < _spatial_indices.at(child_row).size() &&
+         bucket_start(child_row, child) < end;
+         child++) {
+      auto child_start = bucket_start(child_row, child);
+      auto child_end = bucket_end(child_row, child);
+      if (child_start >= cursor && child_end <= end) {
+        children.push_back({child_start - start,
+                            _spatial_indices.at(child_row).at(child).get()});
+        cursor = child_end;
+      }
+    }
+    return children;
+  }
+
+  SuperOptimizedPostfilterTree() {}
+
   SuperOptimizedPostfilterTree(std::shared_ptr<PR> points,
                                const FilterList &filter_values,
                                const parlay::sequence<size_t> &decoding,
                                int32_t cutoff, float split_factor,
                                float shift_factor, BuildParams build_params)
       : _sorted_index_to_original_point_id(decoding), _cutoff(cutoff),
-        _filter_values(filter_values), _points(std::move(points)),
-        _split_factor(split_factor), _shift_factor(shift_factor) {
+        _filter_values(filter_values), _label_search(filter_values),
+        _points(std::move(points)),
+        _split_factor(split_factor), _shift_factor(shift_factor),
+        _build_params(build_params) {
 
     if (split_factor <= 1) {
       throw std::runtime_error("split_factor must be greater than 1");
@@ -131,42 +525,114 @@ private:
       throw std::runtime_error("shift_factor must be between 0 and 1");
     }
 
-    size_t n = _filter_values.size();
-
-    _spatial_indices.push_back(std::vector<SpatialIndexPtr>(1));
-    _spatial_indices.at(0).at(0) = create_index(
-        _filter_values, 0, _filter_values.size(), _points.get(), build_params);
-    _bucket_sizes.push_back(_filter_values.size());
-    _bucket_shifts.push_back(0);
+    SuperTreeGeometry geometry(_filter_values.size(), cutoff, split_factor,
+                               shift_factor, segments_per_bucket());
+    _bucket_sizes = geometry.bucket_sizes;
+    _bucket_shifts = geometry.bucket_shifts;
+    for (size_t num_buckets : geometry.num_buckets) {
+      _spatial_indices.push_back(std::vector<SpatialIndexPtr>(num_buckets));
+    }
 
-    // TODO: Add analysis of expected space, possibly add option to tune
-    // shift_factor and split_factor to maintain a worst case blowup
+    // Rows below row 0 then build one graph per segment and serve their
+    // buckets as views of it
+    _segment_graphs.resize(_spatial_indices.size());
+    bool share_segments = segments_per_bucket() > 0;
 
-    while (_bucket_sizes.back() > cutoff) {
+    // The geometry fixes every (row, bucket) build up front, so they all go
+    // into one pool of tasks instead of being built a row at a time
+    std::vector<BucketBuildTask> tasks;
+    for (size_t row = 0; row < _spatial_indices.size(); row++) {
+      if (share_segments && row > 0) {
+        continue;
+      }
+      for (size_t bucket = 0; bucket < _spatial_indices.at(row).size();
+           bucket++) {
+        tasks.push_back(
+            {row, bucket, bucket_start(row, bucket), bucket_end(row, bucket)});
+      }
+    }
 
-      size_t last_row_bucket_size = _bucket_sizes.back();
-      size_t bucket_size =
-          (last_row_bucket_size + split_factor - 1) / split_factor;
-      size_t bucket_shift = ceil(bucket_size * shift_factor);
-      _bucket_sizes.push_back(bucket_size);
-      _bucket_shifts.push_back(bucket_shift);
+    bool merge = supports_child_merge && build_params.merge_child_graphs;
+    if (!merge) {
+      parlay::par_do(
+          [&] {
+            if (share_segments) {
+              build_segment_graphs();
+            }
+          },
+          [&] {
+            run_bucket_builds(
+                tasks, build_params.verbose, [&](const BucketBuildTask &task) {
+                  _spatial_indices.at(task.row).at(task.bucket) =
+                      create_index(_filter_values, task.start, task.end,
+                                   _points.get(), build_params);
+                });
+          });
+    } else {
+      // Parents are seeded from their children's graphs, so the rows have to
+      // be built from the deepest up
+      if (share_segments) {
+        build_segment_graphs();
+      }
+      for (size_t row = _spatial_indices.size(); row-- > 0;) {
+        auto row_tasks = std::vector<BucketBuildTask>(0);
+        for (auto &task : tasks) {
+          if (task.row == row) {
+            row_tasks.push_back(task);
+          }
+        }
+        run_bucket_builds(
+            row_tasks, build_params.verbose, [&](const BucketBuildTask &task) {
+              _spatial_indices.at(task.row).at(task.bucket) = create_index(
+                  _filter_values, task.start, task.end, _points.get(),
+                  build_params, find_children(task.row, task.start, task.end));
+            });
+      }
+    }
+  }
 
-      // The last bucket start must be at least n - bucket_size
-      // For example, say n is 20, bucket_size is 3, and bucket_shift is 2.
-      // Then the last bucket start must be at least 20 - 3 = 17, and the
-      // total number of buckets is ceil[17/2] + 1 = 10. An equivalent way of
-      // writing this is floor[(17+2-1)/ 2] + 1 = 10.
-      size_t num_buckets =
-          ((n - bucket_size) + bucket_shift - 1) / bucket_shift + 1;
+  // Builds the segment graphs of every row below row 0, all rows at once,
+  // and serves the rows' buckets as views of them
+  void build_segment_graphs() {
+    if constexpr (supports_segment_graphs) {
+      using clock = std::chrono::steady_clock;
+      size_t num_rows = _spatial_indices.size();
+      auto build_time = std::vector<double>(num_rows, 0);
+      parlay::parallel_for(
+          1, num_rows,
+          [&](size_t row) {
+            auto row_start = clock::now();
+            _segment_graphs.at(row) = std::make_unique<SegmentGraphs<T, Point>>(
+                _points.get(), _bucket_shifts.at(row), _build_params);
+            serve_segment_views(row);
+            build_time[row] =
+                std::chrono::duration<double>(clock::now() - row_start)
+                    .count();
+          },
+          1);
+      for (size_t row = 1; _build_params.verbose && row < num_rows; row++) {
+        std::cout << "Row " << row << " (" << _spatial_indices.at(row).size()
+                  << " buckets over shared segment graphs) built in "
+                  << build_time[row] << "s" << std::endl;
+      }
+    }
+  }
 
-      _spatial_indices.push_back(std::vector<SpatialIndexPtr>(num_buckets));
-      parlay::parallel_for(0, num_buckets, [&](auto bucket_id) {
-        size_t bucket_start = bucket_id * bucket_shift;
-        size_t bucket_end = std::min(bucket_start + bucket_size, n);
-        _spatial_indices.back().at(bucket_id) =
-            create_index(_filter_values, bucket_start, bucket_end,
-                         _points.get(), build_params);
-      });
+  // Serves the buckets of row as views of its segment graphs
+  void serve_segment_views(size_t row) {
+    if constexpr (supports_segment_graphs) {
+      parlay::parallel_for(
+          0, _spatial_indices.at(row).size(), [&](size_t bucket) {
+            size_t start = bucket_start(row, bucket);
+            size_t end = bucket_end(row, bucket);
+            _spatial_indices.at(row).at(bucket) =
+                std::make_unique<SpatialIndex>(
+                    _points->make_offset_range(start, end - start),
+                    FilterList(_filter_values.begin() + start,
+                               _filter_values.begin() + end),
+                    _build_params,
+                    _segment_graphs.at(row)->bucket_graph(start, end));
+          });
     }
   }
 
@@ -184,78 +650,96 @@ private:
     return empty;
   }
 
-  parlay::sequence<pid> super_optimized_postfiltering_search(
-      const Point &query, const FilterRange &range, QueryParams query_params) {
-
-    auto start_time = std::chrono::high_resolution_clock::now();
-
-    // if the query range is entirely outside the index range, return
-    if (check_empty(range)) {
-      return parlay::sequence<pid>();
+  // The only bucket of row that can contain all of the sorted points
+  // [inclusive_start, exclusive_end): buckets start every shift points, so
+  // it is the last one starting at or before inclusive_start
+  std::optional<size_t> containing_bucket_in_row(size_t row,
+                                                 size_t inclusive_start,
+                                                 size_t exclusive_end) const {
+    size_t bucket = std::min(inclusive_start / _bucket_shifts.at(row),
+                             _spatial_indices.at(row).size() - 1);
+    if (bucket_end(row, bucket) >= exclusive_end) {
+      return bucket;
     }
+    return std::nullopt;
+  }
 
-    auto inclusive_start =
-        first_greater_than_or_equal_to<FilterType>(range.first, _filter_values);
-    auto exclusive_end = first_greater_than_or_equal_to<FilterType>(
-        range.second, _filter_values);
+  // Returns the (row, bucket) pair of the smallest bucket containing all of
+  // the sorted points [inclusive_start, exclusive_end). Bucket sizes shrink
+  // row by row, so the deepest row whose buckets are large enough is found
+  // by binary search. A window no larger than the size minus the shift of a
+  // row always fits in it, so only a couple of rows are ever tried.
+  std::pair<size_t, size_t> smallest_containing_bucket(size_t inclusive_start,
+                                                       size_t exclusive_end,
+                                                       bool verbose = false) {
+    size_t window_size = exclusive_end - inclusive_start;
+    size_t deepest_row =
+        std::partition_point(
+            _bucket_sizes.begin() + 1, _bucket_sizes.end(),
+            [&](size_t bucket_size) { return bucket_size >= window_size; }) -
+        _bucket_sizes.begin() - 1;
+
+    for (size_t current_row = deepest_row; current_row > 0; current_row--) {
+      auto bucket =
+          containing_bucket_in_row(current_row, inclusive_start, exclusive_end);
+      if (bucket.has_value()) {
+        if (verbose) {
+          std::cout << "Query range = (" << inclusive_start << ","
+                    << exclusive_end << "), smallest containing range (size "
+                    << _bucket_sizes.at(current_row) << ") = ("
+                    << bucket_start(current_row, *bucket) << ","
+                    << bucket_end(current_row, *bucket) << ")" << std::endl;
+        }
+        return {current_row, *bucket};
+      }
+    }
+    return {0, 0};
+  }
 
-    int64_t current_index, current_row = 0;
+  // The [inclusive_start, exclusive_end) sorted points of every query of a
+  // batch, looked up in one parallel pass
+  parlay::sequence<std::pair<size_t, size_t>>
+  label_windows(const std::vector<FilterRange> &filters, size_t num_queries) {
+    return parlay::tabulate(num_queries, [&](size_t i) {
+      return std::make_pair(
+          _label_search.first_greater_than_or_equal_to(filters[i].first),
+          _label_search.first_greater_than_or_equal_to(filters[i].second));
+    });
+  }
 
-    for (current_row = _bucket_sizes.size() - 1; current_row >= 0;
-         current_row--) {
-      if (current_row == 0) {
-        current_index = 0;
-        break;
-      }
+  // smallest_containing_bucket for every window of a batch, with the bucket
+  // arithmetic done as one parallel pass
+  parlay::sequence<std::pair<size_t, size_t>> smallest_containing_buckets(
+      const parlay::sequence<std::pair<size_t, size_t>> &windows) {
+    return parlay::map(windows, [&](const auto &window) {
+      return smallest_containing_bucket(window.first, window.second);
+    });
+  }
 
-      size_t bucket_size = _bucket_sizes.at(current_row);
-      if (bucket_size < exclusive_end - inclusive_start) {
-        continue;
-      }
+  // Queries the bucket that smallest_containing_bucket resolved for range,
+  // which holds window_size points inside it
+  parlay::sequence<pid> super_optimized_postfiltering_search(
+      const Point &query, const FilterRange &range,
+      std::pair<size_t, size_t> bucket, size_t window_size,
+      QueryParams query_params) {
 
-      size_t bucket_shift = _bucket_shifts.at(current_row);
-      size_t first_possible_bucket = inclusive_start / bucket_shift;
-      size_t last_possible_bucket = (exclusive_end - 1) / bucket_shift;
-      first_possible_bucket = std::min(
-          first_possible_bucket, _spatial_indices.at(current_row).size() - 1);
-      last_possible_bucket = std::min(
-          last_possible_bucket, _spatial_indices.at(current_row).size() - 1);
-
-      for (size_t test_bucket = first_possible_bucket;
-           test_bucket <= last_possible_bucket; test_bucket++) {
-        if (query_params.verbose) {
-          std::cout << "Testing bucket " << test_bucket << std::endl;
-        }
-        auto bucket_start = test_bucket * bucket_shift;
-        auto bucket_end =
-            std::min(bucket_start + bucket_size, _filter_values.size());
-        if (inclusive_start >= bucket_start && exclusive_end <= bucket_end) {
-          if (query_params.verbose) {
-            std::cout << "Query range = (" << inclusive_start << ","
-                      << exclusive_end << "), smallest containing range (size "
-                      << bucket_size << ") = (" << bucket_start << ","
-                      << bucket_end << ")" << std::endl;
-          }
-          current_index = test_bucket;
-          goto done;
-        }
-      }
+    // if the query range is entirely outside the index range, return
+    if (check_empty(range)) {
+      return parlay::sequence<pid>();
     }
 
-  done:
-
-    auto bucket_end_time = std::chrono::high_resolution_clock::now();
+    auto [current_row, current_index] = bucket;
     if (query_params.verbose) {
-      std::cout << "Time to find bucket: "
-                << std::chrono::duration_cast<std::chrono::nanoseconds>(
-                       bucket_end_time - start_time)
-                       .count()
-                << "ns" << std::endl;
+      std::cout << "Searching bucket " << current_index << " of row "
+                << current_row << " (size " << _bucket_sizes.at(current_row)
+                << ")" << std::endl;
     }
 
+    auto bucket_end_time = std::chrono::high_resolution_clock::now();
+
     auto result = _spatial_indices.at(current_row)
                       .at(current_index)
-                      ->query(query, range, query_params);
+                      ->query(query, range, query_params, window_size);
 
     if (query_params.verbose) {
       std::cout << "Time to do searcht: "
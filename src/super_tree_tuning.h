@@ -0,0 +1,190 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Grid the tuner searches, split factors from 1 + SPLIT_STEP up to
+// MAX_SPLIT and shift factors strictly between 0 and 1
+constexpr float TUNING_SPLIT_STEP = 0.05;
+constexpr float TUNING_MAX_SPLIT = 8;
+constexpr float TUNING_SHIFT_STEP = 0.01;
+
+/* The rows SuperOptimizedPostfilterTree lays out for n points: row i has
+ * num_buckets[i] buckets of bucket_sizes[i] points starting every
+ * bucket_shifts[i] points, and row 0 is a single bucket over everything.
+ * With segments_per_bucket set, the buckets below row 0 are rounded up to
+ * that many whole shifts, so that they can share per segment graphs. */
+struct SuperTreeGeometry {
+  std::vector<size_t> bucket_sizes;
+  std::vector<size_t> bucket_shifts;
+  std::vector<size_t> num_buckets;
+
+  SuperTreeGeometry(size_t n, int32_t cutoff, float split_factor,
+                    float shift_factor, size_t segments_per_bucket = 0) {
+    bucket_sizes.push_back(n);
+    bucket_shifts.push_back(0);
+    num_buckets.push_back(1);
+
+    while (bucket_sizes.back() > (size_t)cutoff) {
+      size_t last_row_bucket_size = bucket_sizes.back();
+      size_t bucket_size =
+          (last_row_bucket_size + split_factor - 1) / split_factor;
+      size_t bucket_shift = ceil(bucket_size * shift_factor);
+      if (segments_per_bucket > 0) {
+        bucket_shift =
+            (bucket_size + segments_per_bucket - 1) / segments_per_bucket;
+        bucket_size = std::min(bucket_shift * segments_per_bucket, n);
+        if (bucket_size >= last_row_bucket_size) {
+          break;
+        }
+      }
+      bucket_sizes.push_back(bucket_size);
+      bucket_shifts.push_back(bucket_shift);
+
+      // The last bucket start must be at least n - bucket_size
+      // For example, say n is 20, bucket_size is 3, and bucket_shift is 2.
+      // Then the last bucket start must be at least 20 - 3 = 17, and the
+      // total number of buckets is ceil[17/2] + 1 = 10. An equivalent way of
+      // writing this is floor[(17+2-1)/ 2] + 1 = 10.
+      num_buckets.push_back(((n - bucket_size) + bucket_shift - 1) /
+                                bucket_shift +
+                            1);
+    }
+  }
+
+  size_t num_rows() const { return bucket_sizes.size(); }
+
+  // Every window of at most this many points fits in some bucket of row, as
+  // buckets start every shift points
+  size_t guaranteed_window(size_t row) const {
+    if (row == 0) {
+      return bucket_sizes.at(0);
+    }
+    return bucket_sizes.at(row) - bucket_shifts.at(row) + 1;
+  }
+
+  // Points stored over all of the buckets, as a multiple of n, which is
+  // what the bucket graphs take in memory relative to one graph over n
+  double index_multiple() const {
+    double stored = 0;
+    for (size_t row = 0; row < num_rows(); row++) {
+      stored += (double)num_buckets.at(row) * bucket_sizes.at(row);
+    }
+    return stored / bucket_sizes.at(0);
+  }
+
+  // Upper bound on bucket size / window size over windows of rows below
+  // row, those larger than what the next row guarantees to contain and at
+  // most what row does. Windows the deepest row guarantees are left out,
+  // nothing smaller than its buckets can bound their blowup.
+  double worst_blowup(size_t row) const {
+    if (row + 1 >= num_rows()) {
+      return 1;
+    }
+    size_t smallest_window = guaranteed_window(row + 1) + 1;
+    if (smallest_window > guaranteed_window(row)) {
+      return 1;
+    }
+    return (double)bucket_sizes.at(row) / smallest_window;
+  }
+
+  double worst_blowup() const {
+    double worst = 1;
+    for (size_t row = 0; row < num_rows(); row++) {
+      worst = std::max(worst, worst_blowup(row));
+    }
+    return worst;
+  }
+
+  void print() const {
+    for (size_t row = 0; row < num_rows(); row++) {
+      std::cout << "Row " << row << ": " << num_buckets.at(row)
+                << " buckets of " << bucket_sizes.at(row) << " points";
+      if (row + 1 < num_rows()) {
+        std::cout << ", windows of " << guaranteed_window(row + 1) + 1
+                  << " to " << guaranteed_window(row)
+                  << " points, worst blowup " << worst_blowup(row);
+      }
+      std::cout << std::endl;
+    }
+    std::cout << "Index multiple " << index_multiple() << ", worst blowup "
+              << worst_blowup() << " for windows of more than "
+              << guaranteed_window(num_rows() - 1) << " points" << std::endl;
+  }
+};
+
+// Segments of one shift that every bucket below row 0 is made of when the
+// buckets share per segment graphs
+inline size_t super_tree_segments_per_bucket(float shift_factor) {
+  return std::max<long>(std::lround(1 / shift_factor), 2);
+}
+
+struct SuperTreeFactors {
+  float split_factor;
+  float shift_factor;
+};
+
+/* Picks the split and shift factors for n points and the cutoff. The worst
+ * blowup of a window is about split / (1 - shift), while the index multiple
+ * is about the number of rows, log_split(n / cutoff), over shift, so the two
+ * pull against each other. Of the factors that meet both targets, the one
+ * with the smallest index is taken, and if none does, the one with the
+ * smallest worst blowup within max_index_multiple. With
+ * share_segment_graphs, every geometry is rounded to whole segments the way
+ * the tree will build it. */
+inline SuperTreeFactors
+tune_super_tree_factors(size_t n, int32_t cutoff, double max_index_multiple,
+                        double target_blowup,
+                        bool share_segment_graphs = false) {
+  std::optional<SuperTreeFactors> best_feasible, best_within_memory;
+  double best_feasible_multiple = std::numeric_limits<double>::max();
+  double best_within_memory_blowup = std::numeric_limits<double>::max();
+
+  size_t num_splits = std::round((TUNING_MAX_SPLIT - 1) / TUNING_SPLIT_STEP);
+  size_t num_shifts = std::round(1 / TUNING_SHIFT_STEP);
+  for (size_t i = 1; i <= num_splits; i++) {
+    float split = 1 + i * TUNING_SPLIT_STEP;
+    for (size_t j = 1; j < num_shifts; j++) {
+      float shift = j * TUNING_SHIFT_STEP;
+      SuperTreeGeometry geometry(
+          n, cutoff, split, shift,
+          share_segment_graphs ? super_tree_segments_per_bucket(shift) : 0);
+      double multiple = geometry.index_multiple();
+      if (multiple > max_index_multiple) {
+        continue;
+      }
+      double blowup = geometry.worst_blowup();
+      if (blowup <= target_blowup && multiple < best_feasible_multiple) {
+        best_feasible = SuperTreeFactors{split, shift};
+        best_feasible_multiple = multiple;
+      }
+      if (blowup < best_within_memory_blowup) {
+        best_within_memory = SuperTreeFactors{split, shift};
+        best_within_memory_blowup = blowup;
+      }
+    }
+  }
+
+  if (best_feasible.has_value()) {
+    return *best_feasible;
+  }
+  if (!best_within_memory.has_value()) {
+    throw std::runtime_error("No split and shift factors keep the index "
+                             "within " +
+                             std::to_string(max_index_multiple) +
+                             " times the number of points");
+  }
+  std::cout << "No split and shift factors reach a worst blowup of "
+            << target_blowup << " within an index multiple of "
+            << max_index_multiple << ", the lowest is "
+            << best_within_memory_blowup << std::endl;
+  return *best_within_memory;
+}
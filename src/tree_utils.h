@@ -5,6 +5,14 @@
 #include "parlay/primitives.h"
 #include "parlay/sequence.h"
 #include "pybind11/numpy.h"
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
 #include <vector>
 
 namespace py = pybind11;
@@ -36,6 +44,105 @@ inline size_t first_greater_than_or_equal_to(
   return end;
 }
 
+// Returns the query ids 0, ..., num_queries - 1 sorted by bucket_of(id), the
+// (row, bucket) pair of the bucket a query is expected to search, so that a
+// batch can work through the queries of one bucket while its graph and
+// points are still in cache
+template <typename BucketFunction>
+parlay::sequence<size_t> order_queries_by_bucket(size_t num_queries,
+                                                 BucketFunction &&bucket_of) {
+  auto keys = parlay::tabulate(num_queries, [&](size_t i) {
+    return std::make_pair(bucket_of(i), i);
+  });
+  parlay::sort_inplace(keys);
+  return parlay::map(keys, [](const auto &key) { return key.second; });
+}
+
+// Hands the whole pages inside [begin, begin + bytes) back to the kernel.
+// Anonymous pages read back as zeros afterwards and pages of a private file
+// mapping as the file, so the range must not be read again either way.
+inline void release_pages(void *begin, size_t bytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = (reinterpret_cast<uintptr_t>(begin) + page - 1) / page * page;
+  uintptr_t last = (reinterpret_cast<uintptr_t>(begin) + bytes) / page * page;
+  if (last > first) {
+    madvise(reinterpret_cast<void *>(first), last - first, MADV_DONTNEED);
+  }
+}
+
+// A single bucket of a tree, covering sorted points [start, end), whose index
+// still has to be built
+struct BucketBuildTask {
+  size_t row;
+  size_t bucket;
+  size_t start;
+  size_t end;
+};
+
+// Runs build(task) for every task, largest bucket first: every worker keeps
+// taking the largest task not yet started off the sorted list until none are
+// left, so the big builds start right away and the small ones fill the gaps
+// around them. With verbose, prints, per row, the wall time at which its last
+// bucket finished and the summed time spent building its buckets.
+template <typename BuildFunction>
+void run_bucket_builds(std::vector<BucketBuildTask> tasks, bool verbose,
+                       BuildFunction &&build) {
+  using clock = std::chrono::steady_clock;
+
+  std::stable_sort(tasks.begin(), tasks.end(), [](auto &a, auto &b) {
+    return a.end - a.start > b.end - b.start;
+  });
+
+  auto build_start = clock::now();
+  auto started_at = std::vector<double>(tasks.size());
+  auto finished_at = std::vector<double>(tasks.size());
+  std::atomic<size_t> next_task = 0;
+  size_t num_pullers = std::min<size_t>(parlay::num_workers(), tasks.size());
+  parlay::parallel_for(
+      0, num_pullers,
+      [&](size_t) {
+        for (size_t i = next_task++; i < tasks.size(); i = next_task++) {
+          started_at[i] =
+              std::chrono::duration<double>(clock::now() - build_start)
+                  .count();
+          build(tasks[i]);
+          finished_at[i] =
+              std::chrono::duration<double>(clock::now() - build_start)
+                  .count();
+        }
+      },
+      1);
+  if (!verbose) {
+    return;
+  }
+
+  size_t num_rows = 0;
+  for (auto &task : tasks) {
+    num_rows = std::max(num_rows, task.row + 1);
+  }
+  auto row_buckets = std::vector<size_t>(num_rows, 0);
+  auto row_points = std::vector<size_t>(num_rows, 0);
+  auto row_finished_at = std::vector<double>(num_rows, 0);
+  auto row_build_time = std::vector<double>(num_rows, 0);
+  for (size_t i = 0; i < tasks.size(); i++) {
+    auto row = tasks[i].row;
+    row_buckets[row]++;
+    row_points[row] += tasks[i].end - tasks[i].start;
+    row_finished_at[row] = std::max(row_finished_at[row], finished_at[i]);
+    row_build_time[row] += finished_at[i] - started_at[i];
+  }
+  for (size_t row = 0; row < num_rows; row++) {
+    // Rows built by another call, e.g. one row at a time when merging
+    if (row_buckets[row] == 0) {
+      continue;
+    }
+    std::cout << "Row " << row << " (" << row_buckets[row] << " buckets, "
+              << row_points[row] << " points) finished after "
+              << row_finished_at[row] << "s, " << row_build_time[row]
+              << "s spent in bucket builds" << std::endl;
+  }
+}
+
 template <typename FilterType, typename T, typename Point>
 auto sort_python_and_convert(py::array_t<T> points,
                              py::array_t<FilterType> filter_values) {
@@ -74,25 +181,21 @@ auto sort_python_and_convert(py::array_t<T> points,
 
   T *numpy_data = static_cast<T *>(points_buf.ptr);
 
-  auto data_sorted = parlay::sequence<T>(n * dimension);
-  auto decoding = parlay::sequence<size_t>(n, 0);
-
-  parlay::parallel_for(0, n, [&](size_t sorted_id) {
-    for (size_t d = 0; d < dimension; d++) {
-      data_sorted.at(sorted_id * dimension + d) =
-          numpy_data[filter_indices_sorted.at(sorted_id) * dimension + d];
-    }
-    decoding.at(sorted_id) = filter_indices_sorted.at(sorted_id);
-  });
-
+  auto decoding = parlay::sequence<size_t>(n);
   auto filter_values_sorted = FilterList(n);
-  parlay::parallel_for(0, n, [&](auto i) {
-    filter_values_sorted.at(i) =
-        filter_values_seq.at(filter_indices_sorted.at(i));
+  parlay::parallel_for(0, n, [&](size_t sorted_id) {
+    decoding[sorted_id] = filter_indices_sorted[sorted_id];
+    filter_values_sorted[sorted_id] =
+        filter_values_seq[filter_indices_sorted[sorted_id]];
   });
 
+  // The rows are gathered from numpy straight into the aligned storage of
+  // the PointRange, without a sorted copy in between
   std::shared_ptr<PointRange<T, Point>> point_range =
-      std::make_shared<PointRange<T, Point>>(data_sorted.data(), n, dimension);
+      std::make_shared<PointRange<T, Point>>(
+          n, dimension, [&](size_t sorted_id) {
+            return numpy_data + filter_indices_sorted[sorted_id] * dimension;
+          });
 
   return std::make_tuple(point_range, filter_values_sorted, decoding);
 }
\ No newline at end of file
@@ -0,0 +1,76 @@
+import numpy as np
+
+import window_ann
+
+K = 10
+fmt = "=== {:30} ==="
+
+
+def random_dataset(n=20_000, dims=16, num_queries=200, seed=1):
+    rng = np.random.default_rng(seed)
+    points = rng.standard_normal((n, dims), dtype=np.float32)
+    filter_values = rng.random(n, dtype=np.float32)
+    queries = rng.standard_normal((num_queries, dims), dtype=np.float32)
+    return points, filter_values, queries
+
+
+# Windows from the whole label range down to 1/2^(num_widths - 1) of it, by
+# default 1/8192, so that every row of the trees gets searched
+def random_windows(num_queries, low=0.0, high=1.0, num_widths=14, seed=2):
+    rng = np.random.default_rng(seed)
+    widths = (high - low) * 2.0 ** -(np.arange(num_queries) % num_widths)
+    starts = low + rng.random(num_queries) * (high - low - widths)
+    return [
+        (float(np.float32(start)), float(np.float32(start + width)))
+        for start, width in zip(starts, widths)
+    ]
+
+
+# The ids of the k closest points in each window, bounds inclusive, with ids
+# being positions in points
+def brute_force(points, filter_values, queries, filters, k=K):
+    truth = []
+    for query, (low, high) in zip(queries, filters):
+        in_window = np.nonzero((filter_values >= low) & (filter_values <= high))[0]
+        distances = ((points[in_window] - query) ** 2).sum(axis=1)
+        truth.append(in_window[np.argsort(distances, kind="stable")[:k]])
+    return truth
+
+
+# Fraction of the true neighbors that batch_search found. Slots past the end
+# of a window with fewer than k points come back with the largest distance
+def recall(results, truth, k=K):
+    ids, distances = results
+    found = 0
+    expected = 0
+    for row, row_distances, true_ids in zip(ids, distances, truth):
+        in_results = row_distances[:k] < np.finfo(np.float32).max
+        returned = set(row[:k][in_results].tolist())
+        found += len(returned & set(true_ids.tolist()))
+        expected += len(true_ids)
+    return found / max(expected, 1)
+
+
+def query_params(k=K, beam_size=32, **fields):
+    params = window_ann.QueryParams(
+        k, beam_size, 1.35, 10_000_000, 10_000, 1, 10_000, None, False
+    )
+    for name, value in fields.items():
+        setattr(params, name, value)
+    return params
+
+
+def build_params(max_degree=32, limit=64, alpha=1.175, **fields):
+    params = window_ann.BuildParams(max_degree, limit, alpha, "")
+    for name, value in fields.items():
+        setattr(params, name, value)
+    return params
+
+
+# Runs the test_ functions of a script that is run directly rather than
+# through pytest
+def run_tests(namespace):
+    for name, test in list(namespace.items()):
+        if name.startswith("test_") and callable(test):
+            test()
+            print(fmt.format(name + " passed"))
@@ -0,0 +1,90 @@
+# Points appended to a tree in batches are found like those of a tree built
+# over all of the points at once
+import numpy as np
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+in_base = filter_values < 0.6
+
+# Appended batches come in label order, but each batch is shuffled
+rng = np.random.default_rng(3)
+appended = np.nonzero(~in_base)[0]
+appended = appended[np.argsort(filter_values[appended], kind="stable")]
+batches = [rng.permutation(batch) for batch in np.array_split(appended, 7)]
+
+# Ids follow the base points and then the appended ones, in the order they
+# were appended
+order = np.concatenate([np.nonzero(in_base)[0]] + batches)
+all_points = points[order]
+all_filter_values = filter_values[order]
+
+filters = random_windows(len(queries))
+appended_filters = random_windows(len(queries), low=0.6)
+truth = brute_force(all_points, all_filter_values, queries, filters)
+appended_truth = brute_force(
+    all_points, all_filter_values, queries, appended_filters
+)
+
+
+def search(tree, filters, query_method="fenwick"):
+    return tree.batch_search(
+        queries, filters, len(queries), query_method, query_params()
+    )
+
+
+def appended_tree(index_type, **build_fields):
+    tree = index_type(
+        points[in_base],
+        filter_values[in_base],
+        1000,
+        2,
+        build_params(**build_fields),
+    )
+    for batch in batches:
+        tree.append(points[batch], filter_values[batch])
+    return tree
+
+
+def test_append_then_query():
+    index_type = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian
+    rebuilt = index_type(all_points, all_filter_values, 1000, 2, build_params())
+    for build_fields in [{}, {"merge_child_graphs": True}]:
+        tree = appended_tree(index_type, **build_fields)
+        for query_method in ["fenwick", "auto"]:
+            for windows, expected in [
+                (filters, truth),
+                (appended_filters, appended_truth),
+            ]:
+                found = recall(search(tree, windows, query_method), expected)
+                full = recall(search(rebuilt, windows, query_method), expected)
+                assert found >= full - 0.02, (build_fields, found, full)
+
+
+# Appended prefilter buckets and the unsealed leaf are scanned exactly
+def test_append_to_prefilter_tree():
+    tree = appended_tree(window_ann.RangeFilterTreeIndexFloatEuclidian)
+    found = recall(search(tree, appended_filters), appended_truth)
+    assert found >= 0.999, found
+
+
+def test_append_below_largest_label_fails():
+    tree = appended_tree(window_ann.RangeFilterTreeIndexFloatEuclidian)
+    try:
+        tree.append(points[:1], np.array([0.5], dtype=np.float32))
+    except RuntimeError:
+        return
+    assert False, "appending a label below the largest one should fail"
+
+
+if __name__ == "__main__":
+    run_tests(globals())
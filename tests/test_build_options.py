@@ -0,0 +1,65 @@
+# Recall against brute force of Vamana trees built with each of the tree
+# build options, which change how the bucket graphs are built and stored but
+# not what a search over them should find
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+truth = brute_force(points, filter_values, queries, filters)
+
+
+def tree_recall(**build_fields):
+    tree = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian(
+        points, filter_values, 1000, 2, build_params(**build_fields)
+    )
+    return recall(
+        tree.batch_search(queries, filters, len(queries), "fenwick", query_params()),
+        truth,
+    )
+
+
+# Parent buckets are seeded with the union of their children's graphs and
+# only refined by a cross child pass
+def test_merge_child_graphs():
+    found = tree_recall(merge_child_graphs=True)
+    assert found >= 0.95, found
+
+
+# Every row keeps the graphs of its buckets in one block, alone and along
+# with merged child graphs
+def test_level_graph_blocks():
+    for merge_child_graphs in [False, True]:
+        found = tree_recall(
+            level_graph_blocks=True, merge_child_graphs=merge_child_graphs
+        )
+        assert found >= 0.95, (merge_child_graphs, found)
+
+
+# Under a memory budget rows lose degree and then whole rows are dropped,
+# which costs some recall but never the points themselves
+def test_memory_budget():
+    for memory_budget in [4_000_000, 9_000_000]:
+        found = tree_recall(memory_budget=memory_budget)
+        assert found >= 0.9, (memory_budget, found)
+
+
+def test_memory_budget_below_points_fails():
+    try:
+        tree_recall(memory_budget=points.nbytes // 2)
+    except RuntimeError:
+        return
+    assert False, "a budget below the size of the points should fail"
+
+
+if __name__ == "__main__":
+    run_tests(globals())
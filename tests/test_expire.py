@@ -0,0 +1,61 @@
+# Points expired by expire_before are never returned, and the live points
+# are still found as the watermark moves up through the tree
+import numpy as np
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+
+
+def check_expired(tree, points, filter_values, watermark):
+    for query_method in ["fenwick", "three_split", "auto"]:
+        ids, distances = tree.batch_search(
+            queries, filters, len(queries), query_method, query_params()
+        )
+        returned = ids[distances < np.finfo(np.float32).max]
+        assert (filter_values[returned] >= watermark).all(), query_method
+
+        live_filters = [(max(low, watermark), high) for low, high in filters]
+        truth = brute_force(points, filter_values, queries, live_filters)
+        found = recall((ids, distances), truth)
+        assert found >= 0.95, (query_method, watermark, found)
+
+
+def test_expire_before():
+    for index_type in [
+        window_ann.VamanaRangeFilterTreeIndexFloatEuclidian,
+        window_ann.RangeFilterTreeIndexFloatEuclidian,
+    ]:
+        tree = index_type(points, filter_values, 1000, 2, build_params())
+        for watermark in [0.05, 0.3, 0.31, 0.7, 0.99]:
+            tree.expire_before(watermark)
+            check_expired(tree, points, filter_values, watermark)
+
+
+# Expiry goes on into the appended points once the sorted ones are all gone
+def test_expire_appended():
+    in_base = filter_values < 0.5
+    appended = np.nonzero(~in_base)[0]
+    appended = appended[np.argsort(filter_values[appended], kind="stable")]
+    tree = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian(
+        points[in_base], filter_values[in_base], 1000, 2, build_params()
+    )
+    tree.append(points[appended], filter_values[appended])
+    order = np.concatenate([np.nonzero(in_base)[0], appended])
+    for watermark in [0.4, 0.6, 0.8]:
+        tree.expire_before(watermark)
+        check_expired(tree, points[order], filter_values[order], watermark)
+
+
+if __name__ == "__main__":
+    run_tests(globals())
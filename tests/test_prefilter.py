@@ -0,0 +1,64 @@
+# Recall against brute force of PrefilterIndex scans over label sorted
+# copies of the points, and over int8 codes reranked exactly
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+truth = brute_force(points, filter_values, queries, filters)
+
+
+def prefilter_recall(rerank_factor=4, **build_fields):
+    index = window_ann.PrefilterIndexFloatEuclidian(
+        points, filter_values, build_params(**build_fields)
+    )
+    return recall(
+        index.batch_search(
+            queries, filters, len(queries), query_params(rerank_factor=rerank_factor)
+        ),
+        truth,
+    )
+
+
+def test_baseline():
+    found = prefilter_recall()
+    assert found >= 0.999, found
+
+
+# The window is one contiguous run of the sorted copy, scanned exactly
+def test_label_sorted_points():
+    found = prefilter_recall(label_sorted_points=True)
+    assert found >= 0.999, found
+
+
+# Codes pick the closest k * rerank_factor points and exact distances the k
+# among them, so recall only suffers when reranking too few
+def test_quantized_scan():
+    found = prefilter_recall(quantized_scan=True)
+    assert found >= 0.99, found
+    unreranked = prefilter_recall(rerank_factor=1, quantized_scan=True)
+    assert 0.9 <= unreranked <= found, (unreranked, found)
+
+
+def test_quantized_scan_in_tree():
+    tree = window_ann.RangeFilterTreeIndexFloatEuclidian(
+        points, filter_values, 1000, 2, build_params(quantized_scan=True)
+    )
+    found = recall(
+        tree.batch_search(queries, filters, len(queries), "fenwick", query_params()),
+        truth,
+    )
+    assert found >= 0.99, found
+
+
+if __name__ == "__main__":
+    run_tests(globals())
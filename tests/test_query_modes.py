@@ -0,0 +1,137 @@
+# Recall of the tree query modes against brute force, each compared with the
+# default fenwick search over the same index
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+truth = brute_force(points, filter_values, queries, filters)
+
+tree = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian(
+    points, filter_values, 1000, 2, build_params()
+)
+
+
+def search(index, query_method="fenwick", **fields):
+    return index.batch_search(
+        queries, filters, len(queries), query_method, query_params(**fields)
+    )
+
+
+baseline = recall(search(tree), truth)
+
+
+def test_baseline():
+    assert baseline >= 0.95, baseline
+
+
+def test_intra_query_parallel():
+    found = recall(search(tree, intra_query_parallel=True), truth)
+    assert found >= baseline - 0.01, (found, baseline)
+
+
+# Buckets skip candidates that are further than the k-th closest point found
+# in the buckets searched before them
+def test_share_distance_bound():
+    found = recall(search(tree, share_distance_bound=True), truth)
+    assert found >= baseline - 0.01, (found, baseline)
+
+
+# Buckets over exact prefilter scans find the true neighbors wherever the
+# window lands, so any miss comes from the edges scanned outside of them
+def test_edge_scans():
+    exact_tree = window_ann.RangeFilterTreeIndexFloatEuclidian(
+        points, filter_values, 1000, 2, build_params()
+    )
+    found = recall(search(exact_tree), truth)
+    assert found >= 0.999, found
+
+
+# The planner calibrates its cost model on the first "auto" batch and reuses
+# it after, and whichever plan it picks has to keep the recall of fenwick
+def test_auto_planner():
+    for _ in range(2):
+        found = recall(search(tree, "auto"), truth)
+        assert found >= baseline - 0.01, (found, baseline)
+
+
+def test_three_split_and_optimized_postfilter():
+    for query_method in ["three_split", "optimized_postfilter"]:
+        found = recall(search(tree, query_method), truth)
+        assert found >= baseline - 0.02, (query_method, found, baseline)
+
+
+# Reordering only changes which queries run next to each other, each query
+# still gets its own results back
+def test_reorder_by_bucket():
+    for query_method in ["fenwick", "auto"]:
+        found = recall(search(tree, query_method, reorder_by_bucket=True), truth)
+        assert found >= baseline - 0.01, (query_method, found, baseline)
+
+
+# A postfiltered search resumes its beam search when it doubles the beam
+# rather than starting over, which has to find what a fresh search would.
+# Windows narrower than 1/128 of the labels would need beams in the
+# thousands.
+def test_postfilter_doubling():
+    wide_filters = random_windows(len(queries), num_widths=8)
+    wide_truth = brute_force(points, filter_values, queries, wide_filters)
+    index = window_ann.PostfilterVamanaIndexFloatEuclidian(
+        points, filter_values, build_params()
+    )
+    found = recall(
+        index.batch_search(queries, wide_filters, len(queries), query_params()),
+        wide_truth,
+    )
+    assert found >= 0.95, found
+
+
+# Beam searches navigate through points outside of the window but only keep
+# the ones inside it as results
+def test_window_aware_search():
+    for query_method in ["fenwick", "three_split"]:
+        found = recall(search(tree, query_method, window_aware_search=True), truth)
+        assert found >= baseline - 0.01, (query_method, found, baseline)
+
+
+# Postfiltered buckets start from a beam sized by the fraction of the bucket
+# the window covers, with and without doubling when it comes up short
+def test_predicted_beam():
+    for predicted_beam_fallback in [True, False]:
+        for query_method in ["fenwick", "three_split"]:
+            found = recall(
+                search(
+                    tree,
+                    query_method,
+                    predicted_beam_safety=1.0,
+                    predicted_beam_fallback=predicted_beam_fallback,
+                ),
+                truth,
+            )
+            assert found >= baseline - 0.02, (query_method, found, baseline)
+
+
+# Buckets keep an entry point per run of labels, and searches start from the
+# ones the window overlaps instead of a fixed start point
+def test_window_entry_points():
+    entry_tree = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian(
+        points, filter_values, 1000, 2, build_params(window_entry_points=True)
+    )
+    for query_method in ["fenwick", "three_split"]:
+        found = recall(
+            search(entry_tree, query_method, window_entry_points=True), truth
+        )
+        assert found >= baseline - 0.01, (query_method, found, baseline)
+
+
+if __name__ == "__main__":
+    run_tests(globals())
@@ -0,0 +1,115 @@
+# A tree loaded from a snapshot answers every query exactly like the tree
+# that was saved, and keeps answering like it as it is changed after the load
+import os
+import tempfile
+
+import numpy as np
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+
+
+def assert_same_results(saved, loaded, search):
+    saved_ids, saved_distances = search(saved)
+    loaded_ids, loaded_distances = search(loaded)
+    assert np.array_equal(saved_ids, loaded_ids)
+    assert np.array_equal(saved_distances, loaded_distances)
+
+
+def round_trip(index_type, index):
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "index.snapshot")
+        index.save(path)
+        return index_type.load(path)
+
+
+def tree_search(query_method="fenwick", **fields):
+    return lambda tree: tree.batch_search(
+        queries, filters, len(queries), query_method, query_params(**fields)
+    )
+
+
+def test_vamana_tree():
+    index_type = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian
+    tree = index_type(
+        points,
+        filter_values,
+        1000,
+        2,
+        build_params(merge_child_graphs=True, window_entry_points=True),
+    )
+    loaded = round_trip(index_type, tree)
+    assert_same_results(tree, loaded, tree_search())
+    assert_same_results(tree, loaded, tree_search("auto"))
+    assert_same_results(tree, loaded, tree_search(window_entry_points=True))
+
+
+def test_prefilter_tree():
+    index_type = window_ann.RangeFilterTreeIndexFloatEuclidian
+    tree = index_type(points, filter_values, 1000, 2, build_params())
+    assert_same_results(tree, round_trip(index_type, tree), tree_search())
+
+
+def test_super_tree():
+    index_type = window_ann.SuperOptimizedPostfilterTreeIndexFloatEuclidian
+    for share_segment_graphs in [False, True]:
+        tree = index_type(
+            points,
+            filter_values,
+            1000,
+            2,
+            0.5,
+            build_params(share_segment_graphs=share_segment_graphs),
+        )
+        assert_same_results(
+            tree,
+            round_trip(index_type, tree),
+            lambda tree: tree.batch_search(
+                queries, filters, len(queries), query_params()
+            ),
+        )
+
+
+# The build parameters come back with the snapshot, so buckets built after
+# the load are built like the saved ones were
+def test_append_and_expire_after_load():
+    index_type = window_ann.VamanaRangeFilterTreeIndexFloatEuclidian
+    in_base = filter_values < 0.6
+    tree = index_type(
+        points[in_base],
+        filter_values[in_base],
+        1000,
+        2,
+        build_params(merge_child_graphs=True),
+    )
+    loaded = round_trip(index_type, tree)
+    for index in [tree, loaded]:
+        index.append(points[~in_base], filter_values[~in_base])
+        index.expire_before(0.2)
+
+    # Ids follow the base points and then the appended ones
+    all_points = np.concatenate([points[in_base], points[~in_base]])
+    all_filter_values = np.concatenate(
+        [filter_values[in_base], filter_values[~in_base]]
+    )
+    live_filters = [(max(low, 0.2), high) for low, high in filters]
+    truth = brute_force(all_points, all_filter_values, queries, live_filters)
+    expected = recall(tree_search()(tree), truth)
+    found = recall(tree_search()(loaded), truth)
+    assert found >= 0.95, found
+    assert found >= expected - 0.01, (found, expected)
+
+
+if __name__ == "__main__":
+    run_tests(globals())
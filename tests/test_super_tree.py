@@ -0,0 +1,77 @@
+# Recall against brute force of SuperOptimizedPostfilterTree, as tuned and
+# with the buckets of a row sharing segment graphs
+import window_ann
+
+from recall_utils import (
+    brute_force,
+    build_params,
+    query_params,
+    random_dataset,
+    random_windows,
+    recall,
+    run_tests,
+)
+
+points, filter_values, queries = random_dataset()
+filters = random_windows(len(queries))
+truth = brute_force(points, filter_values, queries, filters)
+
+index_type = window_ann.SuperOptimizedPostfilterTreeIndexFloatEuclidian
+
+
+def search(tree):
+    return tree.batch_search(queries, filters, len(queries), query_params())
+
+
+baseline = recall(
+    search(index_type(points, filter_values, 1000, 2, 0.5, build_params())),
+    truth,
+)
+
+
+def test_baseline():
+    assert baseline >= 0.95, baseline
+
+
+# The tuned split and shift factors trade memory for blowup, both of which
+# are bounded, so the recall of the search should not move much
+def test_tuned():
+    tree = index_type.tuned(points, filter_values, 1000, 20, 4, build_params())
+    found = recall(search(tree), truth)
+    assert found >= baseline - 0.02, (found, baseline)
+
+
+# Buckets that overlap search views of per segment graphs stitched together,
+# rather than graphs of their own
+def test_share_segment_graphs():
+    for segment_stitch_degree in [0, 4]:
+        tree = index_type(
+            points,
+            filter_values,
+            1000,
+            2,
+            0.5,
+            build_params(
+                share_segment_graphs=True,
+                segment_stitch_degree=segment_stitch_degree,
+            ),
+        )
+        found = recall(search(tree), truth)
+        assert found >= baseline - 0.02, (segment_stitch_degree, found, baseline)
+
+
+def test_tuned_with_shared_segment_graphs():
+    tree = index_type.tuned(
+        points,
+        filter_values,
+        1000,
+        20,
+        4,
+        build_params(share_segment_graphs=True),
+    )
+    found = recall(search(tree), truth)
+    assert found >= baseline - 0.02, (found, baseline)
+
+
+if __name__ == "__main__":
+    run_tests(globals())